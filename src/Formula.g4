@@ -9,10 +9,18 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | FUNCTION '(' arg (',' arg)* ')'  # Function
     | CELL  # Cell
+    | REF  # Ref
     | NUMBER  # Literal
     ;
 
+// ranges are allowed as function arguments only
+arg
+    : RANGE  # RangeArg
+    | expr  # ExprArg
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +34,11 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+FUNCTION: 'SUM' | 'AVERAGE' | 'MIN' | 'MAX' | 'COUNT' ;
+// cells and ranges of another sheet of the workbook are prefixed with its name
+fragment SHEET: [A-Za-z_][A-Za-z0-9_]* '!' ;
+CELL: SHEET? [A-Z]+[0-9]+ ;
+RANGE: SHEET? [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+ ;
+// reference to a deleted cell or range
+REF: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -4,8 +4,11 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -73,7 +76,16 @@ public:
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out,
                                 ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const FormulaAST::ValueGetter& get_value) const = 0;
+    // Appends instructions evaluating the expression in postfix order
+    virtual void Compile(std::vector<FormulaAST::Instruction>& program) const = 0;
+
+    // Appends instructions passing the expression to the aggregate function
+    virtual void CompileArgument(
+        std::vector<FormulaAST::Instruction>& program
+    ) const {
+        Compile(program);
+        program.emplace_back(FormulaAST::Instruction::Code::Argument);
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -95,7 +107,18 @@ public:
     }
 };
 
+void ExprDeleter::operator()(Expr* expr) const {
+    expr->~Expr();
+}
+
 namespace {
+// Constructs the node in the arena of its tree
+template <typename T, typename... Args>
+ExprPtr MakeExpr(ExprArena& arena, Args&&... args) {
+    void* memory = arena.allocate(sizeof(T), alignof(T));
+    return ExprPtr(new (memory) T(std::forward<Args>(args)...));
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -106,7 +129,7 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, ExprPtr lhs, ExprPtr rhs)
         : type_(type)
         , lhs_(std::move(lhs))
         , rhs_(std::move(rhs)) {
@@ -144,32 +167,33 @@ public:
         }
     }
 
-// Реализуйте метод Evaluate() для бинарных операций.
-// При делении на 0 выбрасывайте ошибку вычисления FormulaError
-    double Evaluate(const FormulaAST::ValueGetter& get_value) const override {
-        const double lhs = lhs_->Evaluate(get_value);
-        const double rhs = rhs_->Evaluate(get_value);
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        using Code = FormulaAST::Instruction::Code;
+
+        lhs_->Compile(program);
+        rhs_->Compile(program);
         switch (type_) {
             case Type::Add:
-                return lhs + rhs;
+                program.emplace_back(Code::Add);
+                break;
             case Type::Subtract:
-                return lhs - rhs;
+                program.emplace_back(Code::Subtract);
+                break;
             case Type::Multiply:
-                return lhs*rhs;
-            case Type::Divide: {
-                double result = lhs/rhs;
-                if (!std::isfinite(result))
-                    throw FormulaError(FormulaError::Category::Div0);
-                return result;
-            } default:
+                program.emplace_back(Code::Multiply);
+                break;
+            case Type::Divide:
+                program.emplace_back(Code::Divide);
+                break;
+            default:
                 throw std::invalid_argument("invalid operand type");
         }
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    ExprPtr lhs_;
+    ExprPtr rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -180,7 +204,7 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, ExprPtr operand)
         : type_(type)
         , operand_(std::move(operand)) {
     }
@@ -201,15 +225,15 @@ public:
         return EP_UNARY;
     }
 
-// Реализуйте метод Evaluate() для унарных операций.
-    double Evaluate(const FormulaAST::ValueGetter& get_value) const override {
-        const double result = operand_->Evaluate(get_value);
-        return type_ == Type::UnaryMinus ? -result : result;
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        operand_->Compile(program);
+        if (type_ == Type::UnaryMinus)
+            program.emplace_back(FormulaAST::Instruction::Code::Negate);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    ExprPtr operand_;
 };
 
 class NumberExpr final : public Expr {
@@ -219,31 +243,48 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        out << value_;
+        PrintValue(out);
     }
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence) const override {
-        out << value_;
+        PrintValue(out);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-// Для чисел метод возвращает значение числа.
-    double Evaluate(const FormulaAST::ValueGetter&) const override {
-        return value_;
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        program.emplace_back(value_);
     }
 
 private:
     double value_;
+
+    // Shortest text parsed back to the same value, so that the printed
+    // formulas are parsed again without changing their numbers
+    void PrintValue(std::ostream& out) const {
+        char number[32];
+        const auto result = std::to_chars(
+            number, number + sizeof(number), value_
+        );
+        out.write(number, result.ptr - number);
+    }
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell) : cell_(cell) {}
+    explicit CellExpr(const Position* cell,
+                      FormulaAST::SheetIndex sheet = 0u,
+                      std::string_view sheet_name = {})
+        : cell_(cell)
+        , sheet_(sheet)
+        , sheet_name_(sheet_name) {
+    }
 
     void Print(std::ostream& out) const override {
+        if (!sheet_name_.empty())
+            out << sheet_name_ << '!';
         if (!cell_->IsValid())
             out << FormulaError(FormulaError::Category::Ref).ToString();
         else
@@ -259,17 +300,283 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const FormulaAST::ValueGetter& get_value) const override {
-        return get_value(*cell_);
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        program.emplace_back(*cell_, sheet_);
+    }
+
+    // Cell is appended to the arguments as a range of one cell
+    void CompileArgument(
+        std::vector<FormulaAST::Instruction>& program
+    ) const override {
+        program.emplace_back(
+            FormulaAST::Instruction::Code::CellArgument, *cell_, sheet_
+        );
     }
 
 private:
     const Position* cell_;
+    FormulaAST::SheetIndex sheet_;
+    std::string_view sheet_name_;
+};
+
+// Reference to a deleted cell or range, evaluates to the #REF! error
+class RefExpr final : public Expr {
+public:
+    void Print(std::ostream& out) const override {
+        out << FormulaError(FormulaError::Category::Ref).ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out,
+                        ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        program.emplace_back(FormulaAST::Instruction::Code::Ref);
+    }
+};
+
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range,
+                       FormulaAST::SheetIndex sheet = 0u,
+                       std::string_view sheet_name = {})
+        : range_(range)
+        , sheet_(sheet)
+        , sheet_name_(sheet_name) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!sheet_name_.empty())
+            out << sheet_name_ << '!';
+        out << range_->ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out,
+                        ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        program.emplace_back(*range_, sheet_);
+    }
+
+    // Range cells are appended to the arguments as they are
+    void CompileArgument(
+        std::vector<FormulaAST::Instruction>& program
+    ) const override {
+        Compile(program);
+    }
+
+private:
+    const Range* range_;
+    FormulaAST::SheetIndex sheet_;
+    std::string_view sheet_name_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    enum Type {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+public:
+    explicit FunctionExpr(Type type, std::pmr::vector<ExprPtr> args)
+        : type_(type)
+        , args_(std::move(args)) {
+    }
+
+    // Returns nothing for unknown names
+    static std::optional<Type> GetType(std::string_view name) {
+        for (Type type : {Sum, Average, Min, Max, Count})
+            if (GetName(type) == name)
+                return type;
+        return std::nullopt;
+    }
+
+    static std::string_view GetName(Type type) {
+        switch (type) {
+            case Sum:
+                return "SUM";
+            case Average:
+                return "AVERAGE";
+            case Min:
+                return "MIN";
+            case Max:
+                return "MAX";
+            case Count:
+                return "COUNT";
+            default:
+                assert(false);
+                return {};
+        }
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName(type_);
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out,
+                        ExprPrecedence /* precedence */) const override {
+        out << GetName(type_) << '(';
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (i > 0)
+                out << ',';
+            // arguments are separated, so they never need parentheses
+            args_[i]->PrintFormula(out, EP_ADD);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<FormulaAST::Instruction>& program) const override {
+        using Code = FormulaAST::Instruction::Code;
+
+        program.emplace_back(Code::BeginArguments);
+        for (const auto& arg : args_)
+            arg->CompileArgument(program);
+
+        switch (type_) {
+            case Type::Sum:
+                program.emplace_back(Code::Sum);
+                break;
+            case Type::Average:
+                program.emplace_back(Code::Average);
+                break;
+            case Type::Min:
+                program.emplace_back(Code::Min);
+                break;
+            case Type::Max:
+                program.emplace_back(Code::Max);
+                break;
+            case Type::Count:
+                program.emplace_back(Code::Count);
+                break;
+            default:
+                throw std::invalid_argument("invalid function type");
+        }
+    }
+
+private:
+    Type type_;
+    std::pmr::vector<ExprPtr> args_;
+};
+
+// Splits the cell or range token into the sheet name and the reference,
+// the name is empty for the formula sheet
+std::pair<std::string_view, std::string_view> SplitSheetName(
+    std::string_view token
+) {
+    const size_t separator = token.find('!');
+    if (separator == std::string_view::npos)
+        return {{}, token};
+
+    return {token.substr(0, separator), token.substr(separator + 1)};
+}
+
+// Copies the value into the arena, so that it lives as long as the nodes
+template <typename T>
+const T* CopyToArena(ExprArena& arena, const T& value) {
+    return new (arena.allocate(sizeof(T), alignof(T))) T(value);
+}
+
+std::string_view CopyToArena(ExprArena& arena, std::string_view text) {
+    char* data = static_cast<char*>(arena.allocate(text.size(), 1u));
+    std::copy(text.begin(), text.end(), data);
+    return {data, text.size()};
+}
+
+// Reference nodes of a parsed formula built the same way by both parsers.
+// Cells and ranges of the formula sheet are listed for the FormulaAST, the
+// references to the other sheets are kept in the arena with their names.
+class ReferenceBuilder {
+public:
+    ExprPtr MakeCell(ExprArena& arena,
+                     std::string_view sheet_name,
+                     Position cell) {
+        if (sheet_name.empty()) {
+            cells_.push_front(cell);
+            return MakeExpr<CellExpr>(arena, &cells_.front());
+        }
+
+        return MakeExpr<CellExpr>(
+            arena,
+            CopyToArena(arena, cell),
+            AddSheet(sheet_name),
+            CopyToArena(arena, sheet_name)
+        );
+    }
+
+    ExprPtr MakeRange(ExprArena& arena,
+                      std::string_view sheet_name,
+                      Range range) {
+        if (sheet_name.empty()) {
+            ranges_.push_front(range);
+            return MakeExpr<RangeExpr>(arena, &ranges_.front());
+        }
+
+        return MakeExpr<RangeExpr>(
+            arena,
+            CopyToArena(arena, range),
+            AddSheet(sheet_name),
+            CopyToArena(arena, sheet_name)
+        );
+    }
+
+    std::forward_list<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+    std::vector<std::string> MoveSheets() {
+        return std::move(sheets_);
+    }
+
+private:
+    std::forward_list<Position> cells_;
+    std::forward_list<Range> ranges_;
+    std::vector<std::string> sheets_;
+
+    // Sheets are numbered from 1 in the order of the first reference
+    FormulaAST::SheetIndex AddSheet(std::string_view name) {
+        auto it = std::find(sheets_.begin(), sheets_.end(), name);
+        if (it == sheets_.end())
+            it = sheets_.emplace(sheets_.end(), name);
+
+        return static_cast<FormulaAST::SheetIndex>(it - sheets_.begin()) + 1u;
+    }
 };
 
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    std::unique_ptr<ExprArena> MoveArena() {
+        return std::move(arena_);
+    }
+
+    ExprPtr MoveRoot() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
@@ -278,7 +585,15 @@ public:
     }
 
     std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+        return references_.MoveCells();
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return references_.MoveRanges();
+    }
+
+    std::vector<std::string> MoveSheets() {
+        return references_.MoveSheets();
     }
 
 public:
@@ -295,7 +610,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        auto node = MakeExpr<UnaryOpExpr>(*arena_, type, std::move(operand));
         args_.back() = std::move(node);
     }
 
@@ -308,19 +623,24 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
+        auto node = MakeExpr<NumberExpr>(*arena_, value);
         args_.push_back(std::move(node));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
+        auto [sheet_name, cell_str] = SplitSheetName(value_str);
+        auto value = Position::FromString(cell_str);
         if (!value.IsValid()) {
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        auto node = references_.MakeCell(*arena_, sheet_name, value);
+        args_.push_back(std::move(node));
+    }
+
+    void exitRef(FormulaParser::RefContext* /* ctx */) override {
+        auto node = MakeExpr<RefExpr>(*arena_);
         args_.push_back(std::move(node));
     }
 
@@ -344,7 +664,8 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(
+        auto node = MakeExpr<BinaryOpExpr>(
+            *arena_,
             type,
             std::move(lhs),
             std::move(rhs)
@@ -352,13 +673,51 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        auto value_str = ctx->RANGE()->getSymbol()->getText();
+        auto [sheet_name, range_str] = SplitSheetName(value_str);
+        auto value = Range::FromString(range_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid range: " + value_str);
+        }
+
+        auto node = references_.MakeRange(*arena_, sheet_name, value);
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t args_count = ctx->arg().size();
+        assert(args_.size() >= args_count);
+
+        auto name = ctx->FUNCTION()->getSymbol()->getText();
+        auto type = FunctionExpr::GetType(name);
+        if (!type) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        std::pmr::vector<ExprPtr> function_args(
+            std::make_move_iterator(args_.end() - args_count),
+            std::make_move_iterator(args_.end()),
+            arena_.get()
+        );
+        args_.resize(args_.size() - args_count);
+
+        auto node = MakeExpr<FunctionExpr>(
+            *arena_,
+            *type,
+            std::move(function_args)
+        );
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::unique_ptr<ExprArena> arena_ = std::make_unique<ExprArena>();
+    std::vector<ExprPtr> args_;
+    ReferenceBuilder references_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -371,6 +730,421 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+
+// Splits the text into the tokens of Formula.g4 grammar the same way as the
+// ANTLR lexer: the longest match, whitespaces are skipped
+class Lexer {
+public:
+    enum class TokenType {
+        Number,
+        Cell,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Comma,
+        Function,
+        Range,
+        Ref,
+        End,
+    };
+
+    struct Token {
+        TokenType type;
+        std::string_view text;
+    };
+
+public:
+    explicit Lexer(std::string_view text) : text_(text) {
+        Next();
+    }
+
+    inline const Token& Get() const {
+        return token_;
+    }
+
+    void Next() {
+        while (
+            offset_ < text_.size()
+            && (text_[offset_] == ' ' || text_[offset_] == '\t'
+                || text_[offset_] == '\n' || text_[offset_] == '\r')
+        )
+            ++offset_;
+
+        const size_t begin = offset_;
+        if (begin == text_.size()) {
+            token_ = {TokenType::End, {}};
+            return;
+        }
+
+        const char c = text_[begin];
+        size_t end = begin + 1;
+        TokenType type;
+        if (IsDigit(c) || c == '.') {
+            // UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            end = SkipDigits(begin);
+            if (
+                end + 1 < text_.size() && text_[end] == '.'
+                && IsDigit(text_[end + 1])
+            )
+                end = SkipDigits(end + 1);
+            else if (end == begin)
+                ThrowTokenError(begin, begin + 1);
+
+            if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (
+                    exponent < text_.size()
+                    && (text_[exponent] == '+' || text_[exponent] == '-')
+                )
+                    ++exponent;
+                if (exponent < text_.size() && IsDigit(text_[exponent]))
+                    end = SkipDigits(exponent);
+            }
+            type = TokenType::Number;
+        } else if (IsNameStart(c)) {
+            // Cell and range may start with the sheet name: [A-Za-z_]
+            // [A-Za-z0-9_]* '!', other names are functions
+            size_t cell_begin = begin;
+            const size_t name_end = SkipName(begin);
+            if (name_end < text_.size() && text_[name_end] == '!')
+                cell_begin = name_end + 1;
+            else if (!IsUpper(c))
+                ThrowTokenError(begin, begin + 1);
+
+            // [A-Z]+[0-9]+ (':' [A-Z]+[0-9]+)? or a function name
+            end = SkipCell(cell_begin);
+            if (end == cell_begin && cell_begin > begin) {
+                ThrowTokenError(begin, begin + 1);
+            } else if (end == begin) {
+                end = SkipLetters(begin);
+                if (!FunctionExpr::GetType(text_.substr(begin, end - begin)))
+                    ThrowTokenError(begin, end + 1);
+                type = TokenType::Function;
+            } else if (
+                end < text_.size() && text_[end] == ':'
+                && SkipCell(end + 1) > end + 1
+            ) {
+                end = SkipCell(end + 1);
+                type = TokenType::Range;
+            } else {
+                type = TokenType::Cell;
+            }
+        } else {
+            switch (c) {
+                case '+':
+                    type = TokenType::Add;
+                    break;
+                case '-':
+                    type = TokenType::Sub;
+                    break;
+                case '*':
+                    type = TokenType::Mul;
+                    break;
+                case '/':
+                    type = TokenType::Div;
+                    break;
+                case '(':
+                    type = TokenType::LeftParen;
+                    break;
+                case ')':
+                    type = TokenType::RightParen;
+                    break;
+                case ',':
+                    type = TokenType::Comma;
+                    break;
+                case '#':
+                    // '#REF!' is the only token starting with '#'
+                    end = begin + REF_TOKEN.size();
+                    if (text_.substr(begin, REF_TOKEN.size()) != REF_TOKEN)
+                        ThrowTokenError(begin, begin + 1);
+                    type = TokenType::Ref;
+                    break;
+                default:
+                    ThrowTokenError(begin, end);
+            }
+        }
+
+        token_ = {type, text_.substr(begin, end - begin)};
+        offset_ = end;
+    }
+
+    // Sheet name of the current cell or range token, empty if there is none
+    std::string_view GetSheetName() const {
+        return SplitSheetName(token_.text).first;
+    }
+
+    // Position of the current cell token, throws FormulaException as the
+    // ANTLR listener does if it is out of the sheet
+    Position GetCell() const {
+        const Position value = Position::FromString(
+            SplitSheetName(token_.text).second
+        );
+        if (!value.IsValid())
+            throw FormulaException(
+                "Invalid position: " + std::string(token_.text)
+            );
+
+        return value;
+    }
+
+    // Range of the current range token, corners are ordered
+    Range GetRange() const {
+        const Range value = Range::FromString(
+            SplitSheetName(token_.text).second
+        );
+        if (!value.IsValid())
+            throw FormulaException(
+                "Invalid range: " + std::string(token_.text)
+            );
+
+        return value;
+    }
+
+private:
+    static constexpr std::string_view REF_TOKEN = "#REF!";
+
+    std::string_view text_;
+    size_t offset_ = 0u;
+    Token token_ = {TokenType::End, {}};
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    static bool IsNameStart(char c) {
+        return IsUpper(c) || (c >= 'a' && c <= 'z') || c == '_';
+    }
+
+    size_t SkipDigits(size_t offset) const {
+        while (offset < text_.size() && IsDigit(text_[offset]))
+            ++offset;
+        return offset;
+    }
+
+    size_t SkipLetters(size_t offset) const {
+        while (offset < text_.size() && IsUpper(text_[offset]))
+            ++offset;
+        return offset;
+    }
+
+    size_t SkipName(size_t offset) const {
+        while (
+            offset < text_.size()
+            && (IsNameStart(text_[offset]) || IsDigit(text_[offset]))
+        )
+            ++offset;
+        return offset;
+    }
+
+    // Returns the end of [A-Z]+[0-9]+ or offset if there is no cell
+    size_t SkipCell(size_t offset) const {
+        const size_t letters_end = SkipLetters(offset);
+        const size_t digits_end = SkipDigits(letters_end);
+        return letters_end > offset && digits_end > letters_end
+               ? digits_end
+               : offset;
+    }
+
+    [[noreturn]] void ThrowTokenError(size_t begin, size_t end) const {
+        throw ParsingError(
+            "Error when lexing: token recognition error at: '"
+            + std::string(text_.substr(begin, end - begin)) + '\''
+        );
+    }
+};
+
+// Hand-written parser of the Formula.g4 grammar building the same tree as
+// the ANTLR parser with ParseASTListener. Binary operators are parsed by
+// precedence climbing, unary ones take a single operand like in the grammar.
+class ExpressionParser {
+    using TokenType = Lexer::TokenType;
+
+public:
+    explicit ExpressionParser(std::string_view text) : lexer_(text) {}
+
+    ExprPtr ParseMain() {
+        auto root = ParseExpr(ADDITIVE_PRECEDENCE);
+        if (lexer_.Get().type != TokenType::End)
+            ThrowUnexpectedToken();
+
+        return root;
+    }
+
+    std::unique_ptr<ExprArena> MoveArena() {
+        return std::move(arena_);
+    }
+
+    std::forward_list<Position> MoveCells() {
+        return references_.MoveCells();
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return references_.MoveRanges();
+    }
+
+    std::vector<std::string> MoveSheets() {
+        return references_.MoveSheets();
+    }
+
+private:
+    static const int ADDITIVE_PRECEDENCE = 1;
+    static const int MULTIPLICATIVE_PRECEDENCE = 2;
+
+    std::unique_ptr<ExprArena> arena_ = std::make_unique<ExprArena>();
+    Lexer lexer_;
+    ReferenceBuilder references_;
+
+    [[noreturn]] void ThrowUnexpectedToken() const {
+        const Lexer::Token& token = lexer_.Get();
+        throw ParsingError(
+            "Error when parsing: "
+            + std::string(token.type == TokenType::End ? "<EOF>" : token.text)
+        );
+    }
+
+    static int GetPrecedence(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+            case TokenType::Sub:
+                return ADDITIVE_PRECEDENCE;
+            case TokenType::Mul:
+            case TokenType::Div:
+                return MULTIPLICATIVE_PRECEDENCE;
+            default:
+                return 0;
+        }
+    }
+
+    // Left associative binary operators of at least min_precedence
+    ExprPtr ParseExpr(int min_precedence) {
+        auto lhs = ParseOperand();
+        for (
+            int precedence = GetPrecedence(lexer_.Get().type);
+            precedence >= min_precedence && precedence > 0;
+            precedence = GetPrecedence(lexer_.Get().type)
+        ) {
+            BinaryOpExpr::Type type;
+            switch (lexer_.Get().type) {
+                case TokenType::Add:
+                    type = BinaryOpExpr::Add;
+                    break;
+                case TokenType::Sub:
+                    type = BinaryOpExpr::Subtract;
+                    break;
+                case TokenType::Mul:
+                    type = BinaryOpExpr::Multiply;
+                    break;
+                default:
+                    type = BinaryOpExpr::Divide;
+            }
+            lexer_.Next();
+
+            auto rhs = ParseExpr(precedence + 1);
+            lhs = MakeExpr<BinaryOpExpr>(
+                *arena_,
+                type,
+                std::move(lhs),
+                std::move(rhs)
+            );
+        }
+
+        return lhs;
+    }
+
+    // FUNCTION '(' arg (',' arg)* ')' where arg is a range or an expression
+    ExprPtr ParseFunction() {
+        const auto type = FunctionExpr::GetType(lexer_.Get().text);
+        lexer_.Next();
+        if (lexer_.Get().type != TokenType::LeftParen)
+            ThrowUnexpectedToken();
+
+        std::pmr::vector<ExprPtr> args(arena_.get());
+        do {
+            lexer_.Next();
+            if (lexer_.Get().type == TokenType::Range) {
+                args.push_back(references_.MakeRange(
+                    *arena_, lexer_.GetSheetName(), lexer_.GetRange()
+                ));
+                lexer_.Next();
+            } else {
+                args.push_back(ParseExpr(ADDITIVE_PRECEDENCE));
+            }
+        } while (lexer_.Get().type == TokenType::Comma);
+
+        if (lexer_.Get().type != TokenType::RightParen)
+            ThrowUnexpectedToken();
+        lexer_.Next();
+
+        return MakeExpr<FunctionExpr>(*arena_, *type, std::move(args));
+    }
+
+    // Parenthesized expression, unary operator, function, cell, deleted
+    // reference or number
+    ExprPtr ParseOperand() {
+        const Lexer::Token token = lexer_.Get();
+        switch (token.type) {
+            case TokenType::LeftParen: {
+                lexer_.Next();
+                auto expr = ParseExpr(ADDITIVE_PRECEDENCE);
+                if (lexer_.Get().type != TokenType::RightParen)
+                    ThrowUnexpectedToken();
+                lexer_.Next();
+                return expr;
+            } case TokenType::Add:
+            case TokenType::Sub: {
+                lexer_.Next();
+                auto operand = ParseOperand();
+                return MakeExpr<UnaryOpExpr>(
+                    *arena_,
+                    token.type == TokenType::Sub
+                    ? UnaryOpExpr::UnaryMinus
+                    : UnaryOpExpr::UnaryPlus,
+                    std::move(operand)
+                );
+            } case TokenType::Cell: {
+                auto cell = references_.MakeCell(
+                    *arena_, lexer_.GetSheetName(), lexer_.GetCell()
+                );
+                lexer_.Next();
+                return cell;
+            } case TokenType::Ref: {
+                lexer_.Next();
+                return MakeExpr<RefExpr>(*arena_);
+            } case TokenType::Number: {
+                lexer_.Next();
+                return MakeExpr<NumberExpr>(*arena_, ParseLiteral(token.text));
+            } case TokenType::Function:
+                return ParseFunction();
+            default:
+                ThrowUnexpectedToken();
+        }
+    }
+
+    // Converts the number as the ANTLR listener does with std::istream: only
+    // overflow to infinity is an error, underflow is not
+    static double ParseLiteral(std::string_view text) {
+        double value = 0;
+        const auto [ptr, error_code] = std::from_chars(
+            text.data(), text.data() + text.size(), value
+        );
+        if (error_code == std::errc::result_out_of_range) {
+            value = std::strtod(std::string(text).c_str(), nullptr);
+            if (std::isinf(value))
+                throw ParsingError("Invalid number: " + std::string(text));
+        } else if (error_code != std::errc()) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+
+        return value;
+    }
+};
 }  // namespace
 }  // namespace ASTImpl
 
@@ -395,35 +1169,391 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(
+        listener.MoveArena(),
+        listener.MoveRoot(),
+        listener.MoveCells(),
+        listener.MoveRanges(),
+        listener.MoveSheets()
+    );
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
     try {
-        return ParseFormulaAST(in);
+        ASTImpl::ExpressionParser parser(in_str);
+        auto root = parser.ParseMain();
+        return FormulaAST(
+            parser.MoveArena(),
+            std::move(root),
+            parser.MoveCells(),
+            parser.MoveRanges(),
+            parser.MoveSheets()
+        );
     } catch (const std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
 }
 
+void TokenizeFormula(
+    std::string_view expression,
+    const std::function<void(std::string_view, std::optional<Range>)>& on_token
+) {
+    using TokenType = ASTImpl::Lexer::TokenType;
+
+    try {
+        for (
+            ASTImpl::Lexer lexer(expression);
+            lexer.Get().type != TokenType::End;
+            lexer.Next()
+        ) {
+            std::optional<Range> reference;
+            if (lexer.Get().type == TokenType::Cell)
+                reference = Range{lexer.GetCell(), lexer.GetCell()};
+            else if (lexer.Get().type == TokenType::Range)
+                reference = lexer.GetRange();
+
+            on_token(lexer.Get().text, reference);
+        }
+    } catch (const ParsingError& exc) {
+        std::throw_with_nested(FormulaException(exc.what()));
+    }
+}
+
 void FormulaAST::Print(std::ostream& out) const {
+    assert(root_expr_);
     root_expr_->Print(out);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
+    assert(root_expr_);
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const ValueGetter& get_value) const {
-    return root_expr_->Evaluate(get_value);
+namespace {
+// Operands stack shared by all the programs executed on the thread; nested
+// executions (a formula reading a dirty cell) work on top of the outer one
+// and leave it as it was on return
+thread_local std::vector<double> execution_stack;
+
+// Collected arguments of the aggregate function calls, shared the same way
+thread_local std::vector<double> execution_arguments;
+
+class ExecutionStackGuard {
+public:
+    ExecutionStackGuard(std::vector<double>& stack)
+        : stack_(stack)
+        , base_(stack.size()) {
+    }
+
+    ~ExecutionStackGuard() {
+        stack_.resize(base_);
+    }
+
+private:
+    std::vector<double>& stack_;
+    size_t base_;
+};
+
+// Reduction kernels keep independent partial results in lanes, so that the
+// compiler turns the loops into SIMD instructions
+const size_t KERNEL_LANES = 4u;
+
+double SumKernel(const double* values, size_t count) {
+    double lanes[KERNEL_LANES] = {};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES)
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane)
+            lanes[lane] += values[i + lane];
+    for (; i < count; ++i)
+        lanes[0] += values[i];
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                       std::forward_list<Position> cells)
-        : root_expr_(std::move(root_expr))
-        , cells_(std::move(cells)) {
+template <typename Select>
+double SelectKernel(const double* values, size_t count, Select select) {
+    if (count == 0u)
+        return .0;
+
+    double lanes[KERNEL_LANES] = {values[0], values[0], values[0], values[0]};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES)
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane)
+            lanes[lane] = select(lanes[lane], values[i + lane]);
+    for (; i < count; ++i)
+        lanes[0] = select(lanes[0], values[i]);
+
+    return select(select(lanes[0], lanes[1]), select(lanes[2], lanes[3]));
+}
+
+FormulaAST::Value Aggregate(FormulaAST::Instruction::Code code,
+                            const double* values,
+                            size_t count) {
+    using Code = FormulaAST::Instruction::Code;
+
+    switch (code) {
+        case Code::Sum:
+            return SumKernel(values, count);
+        case Code::Average:
+            if (count == 0u)
+                return FormulaError(FormulaError::Category::Div0);
+            return SumKernel(values, count)/static_cast<double>(count);
+        case Code::Min:
+            return SelectKernel(values, count, [](double lhs, double rhs) {
+                return rhs < lhs ? rhs : lhs;
+            });
+        case Code::Max:
+            return SelectKernel(values, count, [](double lhs, double rhs) {
+                return lhs < rhs ? rhs : lhs;
+            });
+        case Code::Count:
+            return static_cast<double>(count);
+        default:
+            throw std::invalid_argument("invalid aggregate function");
+    }
+}
+}  // namespace
+
+FormulaAST::Value FormulaAST::Execute(const std::vector<Instruction>& program,
+                                      const ValueGetter& get_value,
+                                      const RangeGetter& get_range,
+                                      Position anchor) {
+    using Code = Instruction::Code;
+
+    std::vector<double>& stack = execution_stack;
+    ExecutionStackGuard guard(stack);
+    std::vector<double>& arguments = execution_arguments;
+    ExecutionStackGuard arguments_guard(arguments);
+
+    for (const Instruction& instruction : program) {
+        switch (instruction.code) {
+            case Code::Number:
+                stack.push_back(instruction.number);
+                break;
+            case Code::Cell: {
+                const Value value = get_value(instruction.sheet, {
+                    anchor.row + instruction.cell.row,
+                    anchor.col + instruction.cell.col
+                });
+                if (std::holds_alternative<FormulaError>(value))
+                    return value;
+                stack.push_back(std::get<double>(value));
+                break;
+            } case Code::Ref:
+                return FormulaError(FormulaError::Category::Ref);
+            case Code::Negate:
+                stack.back() = -stack.back();
+                break;
+            case Code::BeginArguments:
+                // Call arguments start at the current end of the buffer
+                stack.push_back(static_cast<double>(arguments.size()));
+                break;
+            case Code::Argument:
+                arguments.push_back(stack.back());
+                stack.pop_back();
+                break;
+            case Code::Range: {
+                const ::Range range = {
+                    {
+                        anchor.row + instruction.range.first.row,
+                        anchor.col + instruction.range.first.col
+                    },
+                    {
+                        anchor.row + instruction.range.last.row,
+                        anchor.col + instruction.range.last.col
+                    }
+                };
+                if (const auto error = get_range(
+                        instruction.sheet, range, arguments
+                    ))
+                    return *error;
+                break;
+            } case Code::CellArgument: {
+                const Position pos = {
+                    anchor.row + instruction.cell.row,
+                    anchor.col + instruction.cell.col
+                };
+                if (const auto error = get_range(
+                        instruction.sheet, {pos, pos}, arguments
+                    ))
+                    return *error;
+                break;
+            } case Code::Sum:
+            case Code::Average:
+            case Code::Min:
+            case Code::Max:
+            case Code::Count: {
+                const size_t begin = static_cast<size_t>(stack.back());
+                const Value value = Aggregate(
+                    instruction.code,
+                    arguments.data() + begin,
+                    arguments.size() - begin
+                );
+                if (std::holds_alternative<FormulaError>(value))
+                    return value;
+
+                arguments.resize(begin);
+                stack.back() = std::get<double>(value);
+                break;
+            } default: {
+                const double rhs = stack.back();
+                stack.pop_back();
+                double& lhs = stack.back();
+                switch (instruction.code) {
+                    case Code::Add:
+                        lhs += rhs;
+                        break;
+                    case Code::Subtract:
+                        lhs -= rhs;
+                        break;
+                    case Code::Multiply:
+                        lhs *= rhs;
+                        break;
+                    case Code::Divide:
+                        lhs /= rhs;
+                        if (!std::isfinite(lhs))
+                            return FormulaError(FormulaError::Category::Div0);
+                        break;
+                    default:
+                        throw std::invalid_argument("invalid instruction");
+                }
+            }
+        }
+    }
+
+    return stack.back();
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::ExprArena> arena,
+                       ASTImpl::ExprPtr root_expr,
+                       std::forward_list<Position> cells,
+                       std::forward_list<Range> ranges,
+                       std::vector<std::string> sheets)
+        : arena_(std::move(arena))
+        , root_expr_(std::move(root_expr))
+        , cells_(std::move(cells))
+        , ranges_(std::move(ranges))
+        , sheets_(std::move(sheets)) {
     cells_.sort();
+    ranges_.reverse();
+    root_expr_->Compile(program_);
+    program_.shrink_to_fit();
+    CollectSheetRanges();
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::FormulaAST(std::vector<Instruction> program,
+                       std::vector<std::string> sheets)
+        : program_(std::move(program))
+        , sheets_(std::move(sheets)) {
+    using Code = Instruction::Code;
+
+    // Program has to leave exactly one value on the stack and never take
+    // more operands than were pushed before. Stack sizes at the function
+    // calls begin are kept, so that the arguments never take the call values.
+    size_t stack_size = 0u;
+    std::vector<size_t> calls;
+    const auto& require_operands = [&stack_size, &calls](size_t count) {
+        const size_t base = calls.empty() ? 0u : calls.back() + 1u;
+        if (stack_size < base + count)
+            throw FormulaException("invalid program: no operands");
+    };
+    const auto& require_call = [&stack_size, &calls](size_t arguments_count) {
+        if (calls.empty() || stack_size != calls.back() + 1u + arguments_count)
+            throw FormulaException("invalid program: no function call");
+    };
+
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case Code::Number:
+            case Code::Ref:
+                ++stack_size;
+                break;
+            case Code::Cell:
+                if (!instruction.cell.IsValid())
+                    throw FormulaException("invalid program: cell position");
+                if (instruction.sheet > sheets_.size())
+                    throw FormulaException("invalid program: sheet");
+                if (instruction.sheet == 0u)
+                    cells_.push_front(instruction.cell);
+                ++stack_size;
+                break;
+            case Code::Negate:
+                require_operands(1u);
+                break;
+            case Code::Add:
+            case Code::Subtract:
+            case Code::Multiply:
+            case Code::Divide:
+                require_operands(2u);
+                --stack_size;
+                break;
+            case Code::BeginArguments:
+                calls.push_back(stack_size);
+                ++stack_size;
+                break;
+            case Code::Argument:
+                require_call(1u);
+                --stack_size;
+                break;
+            case Code::CellArgument:
+                require_call(0u);
+                if (!instruction.cell.IsValid())
+                    throw FormulaException("invalid program: cell position");
+                if (instruction.sheet > sheets_.size())
+                    throw FormulaException("invalid program: sheet");
+                if (instruction.sheet == 0u)
+                    cells_.push_front(instruction.cell);
+                break;
+            case Code::Range:
+                require_call(0u);
+                if (!instruction.range.IsValid())
+                    throw FormulaException("invalid program: range");
+                if (instruction.sheet > sheets_.size())
+                    throw FormulaException("invalid program: sheet");
+                if (instruction.sheet == 0u)
+                    ranges_.push_front(instruction.range);
+                break;
+            case Code::Sum:
+            case Code::Average:
+            case Code::Min:
+            case Code::Max:
+            case Code::Count:
+                require_call(0u);
+                calls.pop_back();
+                break;
+            default:
+                throw FormulaException("invalid program: instruction code");
+        }
+    }
+    if (stack_size != 1u || !calls.empty())
+        throw FormulaException("invalid program: no result");
+
+    cells_.sort();
+    ranges_.reverse();
+    CollectSheetRanges();
+}
+
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
+FormulaAST::~FormulaAST() = default;
+
+void FormulaAST::CollectSheetRanges() {
+    using Code = Instruction::Code;
+
+    for (const Instruction& instruction : program_) {
+        if (instruction.sheet == 0u)
+            continue;
+
+        const SheetRange reference = {
+            instruction.sheet,
+            instruction.code == Code::Range
+            ? instruction.range
+            : Range{instruction.cell, instruction.cell}
+        };
+        if (
+            std::find(sheet_ranges_.begin(), sheet_ranges_.end(), reference)
+            == sheet_ranges_.end()
+        )
+            sheet_ranges_.push_back(reference);
+    }
+}
\ No newline at end of file
@@ -3,12 +3,29 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// Expression nodes of a tree are placed in a single arena freed at once with
+// the tree, the nodes are destroyed but never deallocated one by one
+using ExprArena = std::pmr::monotonic_buffer_resource;
+
+struct ExprDeleter {
+    void operator()(Expr* expr) const;
+};
+
+using ExprPtr = std::unique_ptr<Expr, ExprDeleter>;
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,19 +34,118 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    using ValueGetter = std::function<double(Position)>;
+    // Errors are passed as values, so that evaluation never throws
+    using Value = std::variant<double, FormulaError>;
+
+    // Sheet of a reference: 0 is the sheet of the formula, i > 0 is the
+    // sheet GetSheets()[i - 1] referred to by name
+    using SheetIndex = uint32_t;
+
+    using ValueGetter = std::function<Value(SheetIndex, Position)>;
+
+    // Appends numbers of the range cells to numbers skipping empty and not
+    // numeric text cells, returns the error of a formula cell if there is one
+    using RangeGetter = std::function<
+        std::optional<FormulaError>(SheetIndex,
+                                    Range,
+                                    std::vector<double>& numbers)
+    >;
+
+    // Cell or range of another sheet, a cell is a range of one cell
+    struct SheetRange {
+        SheetIndex sheet;
+        Range range;
+
+        inline bool operator==(const SheetRange& rhs) const {
+            return sheet == rhs.sheet && range == rhs.range;
+        }
+    };
+
+    // Postfix instruction of the compiled formula program
+    struct Instruction {
+        enum class Code : char {
+            Number,
+            Cell,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Negate,
+
+            // Aggregate function call: the arguments are collected from
+            // the stack and the ranges, then reduced to a single value
+            BeginArguments,
+            Argument,
+            Range,
+            Sum,
+            Average,
+            Min,
+            Max,
+            Count,
+
+            // Reference to a deleted cell, evaluates to #REF!
+            Ref,
+
+            // Cell passed to an aggregate function, read by the rules of
+            // the ranges: empty and text cells are skipped
+            CellArgument,
+        };
+
+        explicit Instruction(Code code) : code(code) {}
+        explicit Instruction(double number)
+            : code(Code::Number), number(number) {}
+        explicit Instruction(Position cell, SheetIndex sheet = 0u)
+            : code(Code::Cell), sheet(sheet), cell(cell) {}
+        Instruction(Code code, Position cell, SheetIndex sheet)
+            : code(code), sheet(sheet), cell(cell) {}
+        explicit Instruction(::Range range, SheetIndex sheet = 0u)
+            : code(Code::Range), sheet(sheet), range(range) {}
+
+        Code code;
+
+        // Sheet of the cell and range references
+        SheetIndex sheet = 0u;
+        union {
+            double number = .0;
+            Position cell;
+            ::Range range;
+        };
+    };
 
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    explicit FormulaAST(std::unique_ptr<ASTImpl::ExprArena> arena,
+                        ASTImpl::ExprPtr root_expr,
+                        std::forward_list<Position> cells,
+                        std::forward_list<Range> ranges = {},
+                        std::vector<std::string> sheets = {});
+    // Restores the formula compiled before, e.g. read from a snapshot. It
+    // has no expression tree and cannot be printed. Throws FormulaException
+    // if the program is malformed.
+    explicit FormulaAST(std::vector<Instruction> program,
+                        std::vector<std::string> sheets = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const ValueGetter& get_value) const;
+    // Runs the compiled program on a stack machine, stops on the first error
+    inline Value Execute(const ValueGetter& get_value,
+                         const RangeGetter& get_range) const {
+        return Execute(program_, get_value, get_range);
+    }
+
+    // Runs the program with the cell positions shifted by anchor
+    static Value Execute(const std::vector<Instruction>& program,
+                         const ValueGetter& get_value,
+                         const RangeGetter& get_range,
+                         Position anchor = {0, 0});
+
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
+    inline const std::vector<Instruction>& GetProgram() const {
+        return program_;
+    }
+
     inline std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -38,14 +154,56 @@ public:
         return cells_;
     }
 
+    inline const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+    // Names of the other sheets referred to by the formula
+    inline const std::vector<std::string>& GetSheets() const {
+        return sheets_;
+    }
+
+    // References to the other sheets without repetitions
+    inline const std::vector<SheetRange>& GetSheetRanges() const {
+        return sheet_ranges_;
+    }
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // holds the nodes of root_expr_, so it is declared before the tree
+    std::unique_ptr<ASTImpl::ExprArena> arena_;
+
+    // is kept for printing only, evaluation runs the program
+    ASTImpl::ExprPtr root_expr_;
+    std::vector<Instruction> program_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+
+    // ranges are single references, their cells are not listed in cells_
+    std::forward_list<Range> ranges_;
+
+    // cells_ and ranges_ are of the formula sheet, the references to the
+    // other sheets are kept apart
+    std::vector<std::string> sheets_;
+    std::vector<SheetRange> sheet_ranges_;
+
+    void CollectSheetRanges();
 };
 
+// Reference parser generated by ANTLR from Formula.g4
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+
+// Hand-written parser of the same grammar building the same tree, throws
+// FormulaException if the formula is invalid
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Splits the expression into the tokens of the same grammar without parsing.
+// on_token gets the referenced range for cell and range tokens, a cell is a
+// range of one cell. Tokens of the other sheets references keep the sheet
+// name: Sheet2!A1. Throws FormulaException on invalid tokens.
+void TokenizeFormula(
+    std::string_view expression,
+    const std::function<void(std::string_view, std::optional<Range>)>& on_token
+);
\ No newline at end of file
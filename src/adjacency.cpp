@@ -0,0 +1,140 @@
+#include "adjacency.h"
+
+#include <algorithm>
+
+std::vector<CellId> AdjacencyLists::Get(CellId node) const {
+    const auto [begin, end] = GetList(node);
+    return {begin, end};
+}
+
+void AdjacencyLists::Add(CellId node, CellId id) {
+    const auto [begin, end] = GetList(node);
+    Patch& patch = GetPatch(node, static_cast<size_t>(end - begin) + 1u);
+    patch_ids_[patch.begin + patch.size++] = id;
+    MergeIfDue();
+}
+
+void AdjacencyLists::Remove(CellId node, CellId id) {
+    if (IsEmpty(node))
+        return;
+
+    Patch& patch = GetPatch(node, 0u);
+    const auto begin = patch_ids_.begin() + patch.begin;
+    const auto end = begin + patch.size;
+    const auto it = std::find(begin, end, id);
+    if (it != end) {
+        *it = *(end - 1);
+        --patch.size;
+    }
+    MergeIfDue();
+}
+
+void AdjacencyLists::Assign(CellId node, const std::vector<CellId>& ids) {
+    if (ids.empty() && IsEmpty(node))
+        return;
+
+    Patch& patch = GetPatch(node, ids.size());
+    std::copy(ids.begin(), ids.end(), patch_ids_.begin() + patch.begin);
+    patch.size = static_cast<uint32_t>(ids.size());
+    MergeIfDue();
+}
+
+void AdjacencyLists::Clear() {
+    offsets_.clear();
+    ids_.clear();
+    patch_indices_.clear();
+    patches_.clear();
+    patch_ids_.clear();
+}
+
+size_t AdjacencyLists::GetIdsCount() const {
+    const size_t nodes_count = GetNodesCount();
+    size_t count = 0u;
+    for (size_t node = 0; node < nodes_count; ++node) {
+        const auto [begin, end] = GetList(static_cast<CellId>(node));
+        count += static_cast<size_t>(end - begin);
+    }
+    return count;
+}
+
+size_t AdjacencyLists::GetCapacityBytes() const {
+    size_t bytes = offsets_.capacity()*sizeof(uint32_t)
+                   + ids_.capacity()*sizeof(CellId)
+                   + patch_indices_.capacity()*sizeof(uint32_t)
+                   + patches_.capacity()*sizeof(Patch)
+                   + patch_ids_.capacity()*sizeof(CellId);
+    return bytes;
+}
+
+size_t AdjacencyLists::GetNodesCount() const {
+    return std::max(
+        offsets_.empty() ? 0u : offsets_.size() - 1u,
+        patch_indices_.size()
+    );
+}
+
+AdjacencyLists::Patch& AdjacencyLists::GetPatch(CellId node, size_t size) {
+    if (node >= patch_indices_.size())
+        patch_indices_.resize(static_cast<size_t>(node) + 1u, NO_PATCH);
+
+    uint32_t& patch_index = patch_indices_[node];
+    if (patch_index == NO_PATCH) {
+        const auto [begin, end] = GetList(node);
+        const size_t row_size = static_cast<size_t>(end - begin);
+        const size_t capacity = std::max(size, row_size);
+        patch_index = static_cast<uint32_t>(patches_.size());
+        const size_t patch_begin = patch_ids_.size();
+        patch_ids_.resize(patch_begin + capacity);
+        std::copy(begin, end, patch_ids_.begin() + patch_begin);
+        patches_.push_back({
+            static_cast<uint32_t>(patch_begin),
+            static_cast<uint32_t>(row_size),
+            static_cast<uint32_t>(capacity)
+        });
+        return patches_.back();
+    }
+
+    // Grown patch is copied to the end of the buffer, its old space is left
+    // until the merge
+    Patch& patch = patches_[patch_index];
+    if (size > patch.capacity) {
+        const size_t begin = patch_ids_.size();
+        const size_t capacity = std::max<size_t>({size, 2u*patch.capacity, 4u});
+        patch_ids_.resize(begin + capacity);
+        std::copy_n(
+            patch_ids_.begin() + patch.begin,
+            patch.size,
+            patch_ids_.begin() + begin
+        );
+        patch.begin = static_cast<uint32_t>(begin);
+        patch.capacity = static_cast<uint32_t>(capacity);
+    }
+    return patch;
+}
+
+void AdjacencyLists::MergeIfDue() {
+    if (patch_ids_.size() >= std::max(ids_.size(), MIN_MERGED_IDS))
+        Merge();
+}
+
+void AdjacencyLists::Merge() {
+    const size_t nodes_count = GetNodesCount();
+
+    std::vector<uint32_t> offsets;
+    std::vector<CellId> ids;
+    offsets.reserve(nodes_count + 1u);
+    ids.reserve(ids_.size() + patch_ids_.size());
+    offsets.push_back(0u);
+    for (size_t node = 0; node < nodes_count; ++node) {
+        const auto [begin, end] = GetList(static_cast<CellId>(node));
+        ids.insert(ids.end(), begin, end);
+        offsets.push_back(static_cast<uint32_t>(ids.size()));
+    }
+    ids.shrink_to_fit();
+
+    offsets_ = std::move(offsets);
+    ids_ = std::move(ids);
+    patch_indices_.clear();
+    patches_.clear();
+    patch_ids_.clear();
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Dense id of a sheet cell given by the storage, ids of the released cells
+// stay with them and are reused with the cells
+using CellId = uint32_t;
+
+// Adjacency lists of the cells by their ids, e.g. the edges of the formula
+// dependency graph. Lists are kept in compressed sparse rows: the ids of all
+// the lists in one array and the offset of each list in it, 4 bytes per
+// edge. A changed list is moved to a patch replacing its row. Patches share
+// one buffer, a grown patch moves to its end and leaves its space unused.
+// The patches are merged back into the rows once the buffer holds as many
+// ids as the rows, so that an edit never rebuilds the arrays.
+class AdjacencyLists {
+public:
+    // Calls fn(id) for each id of the node list
+    template <typename Fn>
+    inline void ForEach(CellId node, Fn fn) const {
+        const auto [begin, end] = GetList(node);
+        for (const CellId* it = begin; it != end; ++it)
+            fn(*it);
+    }
+
+    inline bool IsEmpty(CellId node) const {
+        const auto [begin, end] = GetList(node);
+        return begin == end;
+    }
+
+    std::vector<CellId> Get(CellId node) const;
+
+    // Appends the id missing in the node list
+    void Add(CellId node, CellId id);
+
+    // Removes the id from the node list if it is there, the order of the
+    // rest of the list is not kept
+    void Remove(CellId node, CellId id);
+
+    void Assign(CellId node, const std::vector<CellId>& ids);
+
+    void Clear();
+
+    // Number of ids in all the lists
+    size_t GetIdsCount() const;
+
+    // Bytes reserved by the rows and the patches
+    size_t GetCapacityBytes() const;
+
+private:
+    static constexpr uint32_t NO_PATCH = UINT32_MAX;
+
+    // Ids held by the patches before they are merged into the empty rows
+    static constexpr size_t MIN_MERGED_IDS = 1024u;
+
+    // Row of node i is [offsets_[i], offsets_[i + 1]) of ids_, nodes
+    // created after the last merge have no rows
+    std::vector<uint32_t> offsets_;
+    std::vector<CellId> ids_;
+
+    // List of a node in [begin, begin + size) of patch_ids_, the space up to
+    // begin + capacity is kept for the list to grow in place
+    struct Patch {
+        uint32_t begin;
+        uint32_t size;
+        uint32_t capacity;
+    };
+
+    // Index of the patch replacing the row of each node
+    std::vector<uint32_t> patch_indices_;
+    std::vector<Patch> patches_;
+    std::vector<CellId> patch_ids_;
+
+    inline std::pair<const CellId*, const CellId*> GetList(
+        CellId node
+    ) const {
+        if (node < patch_indices_.size() && patch_indices_[node] != NO_PATCH) {
+            const Patch& patch = patches_[patch_indices_[node]];
+            const CellId* begin = patch_ids_.data() + patch.begin;
+            return {begin, begin + patch.size};
+        }
+        if (static_cast<size_t>(node) + 1u < offsets_.size())
+            return {
+                ids_.data() + offsets_[node],
+                ids_.data() + offsets_[node + 1u]
+            };
+        return {nullptr, nullptr};
+    }
+
+    // Nodes having a row or a patch
+    size_t GetNodesCount() const;
+
+    // Returns the patch of the node with the space for at least size ids,
+    // the row is copied on the first change
+    Patch& GetPatch(CellId node, size_t size);
+
+    // Merges the patches once the buffer has grown to the size of the rows
+    void MergeIfDue();
+
+    void Merge();
+};
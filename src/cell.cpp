@@ -1,64 +1,852 @@
 #include "cell.h"
 
+#include "storage.h"
+#include "workbook.h"
+
+#include <algorithm>
 #include <cassert>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace {
+// Levels smaller than this are not worth waking up the workers
+const size_t MIN_PARALLEL_LEVEL_SIZE = 1024u;
+
+// Number of cells a worker takes from the level at once
+const size_t WORKER_CHUNK_SIZE = 64u;
+
+// Scratch storage of Cell::Validate() reused by all the passes
+std::atomic<size_t> validation_epoch = {0u};
+thread_local std::vector<const Cell*> validation_stack;
+
+// Scratch storage of Cell::DropDependentCache() reused by all the edits
+thread_local std::vector<Cell*> invalidation_stack;
+
+// Calls fn(i) for i in [0, count) on workers_count threads. Workers take
+// chunks from the shared counter until all is done, so that the faster ones
+// pick up the rest of the work. The first thrown exception is rethrown.
+template <typename Fn>
+void ForEachParallel(size_t count, size_t workers_count, Fn fn) {
+    if (workers_count <= 1u || count < MIN_PARALLEL_LEVEL_SIZE) {
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next_chunk = {0u};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    const auto& work = [&]() {
+        try {
+            for (
+                size_t begin = next_chunk.fetch_add(WORKER_CHUNK_SIZE);
+                begin < count;
+                begin = next_chunk.fetch_add(WORKER_CHUNK_SIZE)
+            )
+                for (
+                    size_t i = begin;
+                    i < std::min(begin + WORKER_CHUNK_SIZE, count);
+                    ++i
+                )
+                    fn(i);
+        } catch (...) {
+            std::lock_guard guard(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            next_chunk = count;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(workers_count - 1u);
+    for (size_t i = 1u; i < workers_count; ++i)
+        workers.emplace_back(work);
+    work();
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Contexts of the sheets the formula refers to by name, in the order of the
+// formula sheet indices
+std::unique_ptr<const std::vector<Cell::Context*>> FindSheets(
+    const Cell::Context& context,
+    const FormulaInterface& formula
+) {
+    const std::vector<std::string>& names = formula.GetReferencedSheets();
+    if (names.empty())
+        return nullptr;
+
+    auto sheets = std::make_unique<std::vector<Cell::Context*>>();
+    sheets->reserve(names.size());
+    for (const std::string& name : names) {
+        Cell::Context* sheet = context.workbook
+                               ? context.workbook->FindContext(name)
+                               : nullptr;
+        if (!sheet)
+            throw FormulaException("unknown sheet " + name);
+        sheets->push_back(sheet);
+    }
+    return sheets;
+}
+}  // namespace
+
+Cell::Content::Content(std::string text) {
+    const FormulaInterface::Value number = ParseNumber(
+        std::string_view(text).substr(text.front() == ESCAPE_SIGN ? 1u : 0u)
+    );
+    if (std::holds_alternative<double>(number)) {
+        kind_ = ContentKind::Number;
+        new (&text_) TextData{std::move(text), std::get<double>(number)};
+    } else {
+        kind_ = ContentKind::Text;
+        new (&text_) TextData{std::move(text), .0};
+    }
+}
+
+Cell::Content::Content(Context& context,
+                       std::unique_ptr<FormulaInterface> formula,
+                       std::optional<FormulaInterface::Value> cache)
+        : kind_(ContentKind::Formula) {
+    std::unique_ptr<const std::vector<Context*>> sheets
+        = FindSheets(context, *formula);
+    new (&formula_) FormulaData{
+        &context, std::move(formula), std::move(cache), std::move(sheets)
+    };
+}
+
+Cell::Content::Content(Content&& other) noexcept {
+    *this = std::move(other);
+}
+
+Cell::Content& Cell::Content::operator=(Content&& other) noexcept {
+    if (this == &other)
+        return *this;
+
+    Destroy();
+    if (other.kind_ == ContentKind::Formula)
+        new (&formula_) FormulaData(std::move(other.formula_));
+    else if (other.kind_ != ContentKind::Empty)
+        new (&text_) TextData(std::move(other.text_));
+    kind_ = other.kind_;
+    return *this;
+}
+
+void Cell::Content::Destroy() {
+    if (kind_ == ContentKind::Formula)
+        formula_.~FormulaData();
+    else if (kind_ != ContentKind::Empty)
+        text_.~TextData();
+    kind_ = ContentKind::Empty;
+}
+
+std::vector<Cell::RangeReference> Cell::Content::GetReferencedRanges() const {
+    std::vector<RangeReference> references;
+    if (kind_ != ContentKind::Formula)
+        return references;
+
+    for (const Range& range : formula_.formula->GetReferencedRanges())
+        references.push_back({formula_.context, range});
+    if (formula_.sheets)
+        for (const auto& [sheet, range] : formula_.formula->GetSheetRanges())
+            references.push_back({(*formula_.sheets)[sheet - 1u], range});
+    return references;
+}
+
+FormulaInterface::Value Cell::Content::Evaluate() const {
+    return formula_.formula->Evaluate(
+        [this](FormulaAST::SheetIndex sheet, Position pos) {
+            return GetReferencedNumber(GetSheetContext(sheet), pos);
+        },
+        [this](FormulaAST::SheetIndex sheet,
+               Range range,
+               std::vector<double>& numbers) {
+            return GetRangeNumbers(GetSheetContext(sheet), range, numbers);
+        }
+    );
+}
+
+void Cell::UnlinkRanges() {
+    for (const auto& [context, range] : referenced_ranges_)
+        context->ranges.Erase(range, this);
+    referenced_ranges_.clear();
+}
+
+void Cell::Invalidate() {
+    if (IsCached()) {
+        DropCache();
+        ++context_.cache_statistics.invalidations;
+    }
+    DropDependentCache();
+}
+
+bool Cell::Move(Position offset) {
+    if (!content_.Move(offset))
+        return false;
+
+    for (auto& [context, range] : referenced_ranges_) {
+        context->ranges.Erase(range, this);
+        range = {
+            {range.first.row + offset.row, range.first.col + offset.col},
+            {range.last.row + offset.row, range.last.col + offset.col}
+        };
+        context->ranges.Insert(range, this);
+    }
+
+    StoreValue();
+    return true;
+}
 
 void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> updated_impl = std::make_unique<EmptyImpl>();
+    Content updated_content = MakeContent(std::move(text));
+
+    Validate(updated_content);
+
+    DropDependentCache();
+    UpdateCellsGraph(updated_content);
+
+    content_ = std::move(updated_content);
+    StoreValue();
+}
+
+Cell::Content Cell::MakeContent(std::string text) const {
     if (!text.empty() && text[0] == FORMULA_SIGN && text.size() > 1u)
-        updated_impl = std::make_unique<FormulaImpl>(sheet_, text.substr(1));
+        return Content(
+            context_,
+            context_.formulas.Parse(text.substr(1), pos_)
+        );
     else if (!text.empty())
-        updated_impl = std::make_unique<TextImpl>(text);
+        return Content(std::move(text));
+    else
+        return Content();
+}
 
-    Validate(updated_impl);
+FormulaInterface::Value Cell::GetReferencedNumber(const Context& context,
+                                                  Position pos) {
+    using Tag = ValueStore::Tag;
 
-    DropDependentCache();
-    UpdateCellsGraph(updated_impl);
+    if (!pos.IsValid())
+        return FormulaError(FormulaError::Category::Ref);
+
+    const ValueStore::Value value = context.values.Get(pos);
+    if (value.tag == Tag::Empty)
+        return .0;
+    if (value.tag == Tag::Dirty) {
+        // Dirty cells are evaluated out of the dependency order only if
+        // read directly, not by Recalculate()
+        return context.cells.Find(pos)->GetNumber();
+    }
+
+    ++context.cache_statistics.hits;
+    if (value.tag == Tag::Number)
+        return value.number;
+    else if (value.tag == Tag::Text)
+        return FormulaError(FormulaError::Category::Value);
+    else
+        return FormulaError(static_cast<FormulaError::Category>(value.number));
+}
+
+std::optional<FormulaError> Cell::GetRangeNumbers(
+    const Context& context,
+    Range range,
+    std::vector<double>& numbers
+) {
+    using Tag = ValueStore::Tag;
+
+    std::optional<FormulaError> error;
+    for (int col = range.first.col; col <= range.last.col && !error; ++col)
+        context.values.ForEachSegment(
+            col, range.first.row, range.last.row,
+            [&context, &numbers, &error, col](int first_row,
+                                              const Tag* tags,
+                                              const double* values,
+                                              size_t count) {
+                if (error)
+                    return;
+
+                // Values are copied without branching on the common tags,
+                // the copied value is kept if it is a number
+                size_t size = numbers.size();
+                size_t hits = 0u;
+                numbers.resize(size + count);
+                for (size_t i = 0; i < count; ++i) {
+                    Tag tag = tags[i];
+                    if (tag == Tag::Dirty) {
+                        context.cells.Find({
+                            first_row + static_cast<int>(i), col
+                        })->Actualize();
+                        tag = tags[i];
+                    } else {
+                        hits += tag != Tag::Empty ? 1u : 0u;
+                    }
+                    if (tag == Tag::Error) {
+                        error = FormulaError(
+                            static_cast<FormulaError::Category>(values[i])
+                        );
+                        break;
+                    }
+
+                    numbers[size] = values[i];
+                    size += tag == Tag::Number ? 1u : 0u;
+                }
+                numbers.resize(size);
+                context.cache_statistics.hits += hits;
+            }
+        );
+
+    return error;
+}
 
-    impl_ = std::move(updated_impl);
+template <typename Fn>
+void Cell::ForEachDependent(Fn fn) const {
+    const CellStorage& cells = context_.cells;
+    context_.dependents.ForEach(id_, [&cells, &fn](CellId dependent_id) {
+        fn(cells.Get(dependent_id));
+    });
+
+    // Cells referring to a range are not kept as dependents of its cells
+    if (!context_.ranges.IsEmpty())
+        context_.ranges.ForEachDependent(pos_, fn);
+}
+
+template <typename Fn>
+void Cell::ForEachPrecedent(Fn fn) const {
+    const CellStorage& cells = context_.cells;
+    context_.precedents.ForEach(id_, [&cells, &fn](CellId referenced_id) {
+        fn(static_cast<const Cell*>(cells.Get(referenced_id)));
+    });
+
+    for (const auto& [context, range] : referenced_ranges_)
+        context->cells.ForEachInRange(range, [&fn](const Cell& cell) {
+            fn(&cell);
+        });
 }
 
-void Cell::Validate(const std::vector<Position>& referenced_cells,
-                    std::unordered_set<const Cell*>& validated_cells) const {
-    for (const Position& pos : referenced_cells) {
-        const Cell* ref_cell = reinterpret_cast<Cell*>(sheet_.GetCell(pos));
+void Cell::Validate(
+    const std::vector<Position>& referenced_cells,
+    const std::vector<RangeReference>& referenced_ranges
+) const {
+    // Cells visited by the current pass are marked with a new epoch, so that
+    // neither marks nor the stack have to be allocated or cleared
+    const size_t epoch = ++validation_epoch;
+    std::vector<const Cell*>& stack = validation_stack;
+    stack.clear();
 
-        if (this == ref_cell) {
+    const auto& visit = [this, epoch, &stack](const Cell* ref_cell) {
+        if (this == ref_cell)
             throw CircularDependencyException("circular dependency");
-        } else if (
-            ref_cell && validated_cells.find(ref_cell) != validated_cells.end()
-        ) {
-            validated_cells.insert(ref_cell);
-            Validate(ref_cell->GetReferencedCells(), validated_cells);
+
+        if (ref_cell->validation_epoch_ != epoch) {
+            ref_cell->validation_epoch_ = epoch;
+            stack.push_back(ref_cell);
         }
+    };
+
+    for (const Position& pos : referenced_cells)
+        if (const Cell* ref_cell = context_.cells.Find(pos))
+            visit(ref_cell);
+    for (const auto& [context, range] : referenced_ranges) {
+        if (context == &context_ && range.Contains(pos_))
+            throw CircularDependencyException("circular dependency");
+
+        context->cells.ForEachInRange(range, [&visit](const Cell& ref_cell) {
+            visit(&ref_cell);
+        });
+    }
+
+    while (!stack.empty()) {
+        const Cell* ref_cell = stack.back();
+        stack.pop_back();
+
+        ref_cell->ForEachPrecedent(visit);
     }
 }
 
-void Cell::DropDependentCache(
-    std::unordered_set<const Cell*>& dropped_cache_cells
-) {
-    for (Cell* dependent_cell : dependent_cells_) {
-        if (dropped_cache_cells.find(dependent_cell) != dropped_cache_cells.end()) {
-            dependent_cell->impl_->DropCache();
-            dropped_cache_cells.insert(dependent_cell);
+void Cell::DropDependentCache() {
+    invalidation_stack.assign(1u, this);
+    DropStackedDependentCache();
+}
+
+void Cell::DropDependentCache(const std::vector<Cell*>& cells) {
+    invalidation_stack.assign(cells.begin(), cells.end());
+    DropStackedDependentCache();
+}
+
+void Cell::DropStackedDependentCache() {
+    std::vector<Cell*>& stack = invalidation_stack;
 
-            dependent_cell->DropDependentCache(dropped_cache_cells);
+    // Formulas are evaluated after all their precedents, so the dependents
+    // of a dirty cell are dirty too and the walk stops at the dirty cells.
+    // Dropped caches are counted by the sheets of the dropping cells.
+    Context* context = nullptr;
+    size_t dropped_count = 0u;
+    const auto& add_dropped_count = [&context, &dropped_count]() {
+        if (context)
+            context->cache_statistics.invalidations += dropped_count;
+        dropped_count = 0u;
+    };
+    const auto& visit = [&](Cell* dependent_cell) {
+        if (dependent_cell->IsCached()) {
+            if (&dependent_cell->context_ != context) {
+                add_dropped_count();
+                context = &dependent_cell->context_;
+            }
+            dependent_cell->DropCache();
+            ++dropped_count;
+            stack.push_back(dependent_cell);
         }
+    };
+
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+
+        cell->ForEachDependent(visit);
     }
+
+    add_dropped_count();
 }
 
-void Cell::UpdateCellsGraph(const std::unique_ptr<Impl>& updated_impl) {
+void Cell::StoreValue() const {
+    using Tag = ValueStore::Tag;
+
+    if (!content_.IsCached()) {
+        context_.values.Set(pos_, Tag::Dirty);
+        return;
+    }
+
+    const RangeNumber number = content_.GetRangeNumber();
+    if (!number)
+        context_.values.Set(pos_, content_.IsEmpty() ? Tag::Empty : Tag::Text);
+    else if (std::holds_alternative<double>(*number))
+        context_.values.Set(pos_, Tag::Number, std::get<double>(*number));
+    else
+        context_.values.Set(
+            pos_,
+            Tag::Error,
+            static_cast<double>(std::get<FormulaError>(*number).GetCategory())
+        );
+}
+
+std::vector<CellId> Cell::FindCellIds(
+    const std::vector<Position>& positions
+) const {
+    std::vector<CellId> ids;
+    ids.reserve(positions.size());
+    for (const Position& pos : positions)
+        if (const Cell* cell = context_.cells.Find(pos))
+            ids.push_back(cell->id_);
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+void Cell::UpdateCellsGraph(const Content& updated_content) {
     // Erase this cell in all currently dependent cells
-    for (const Position& referenced_pos : referenced_cells_)
-        if (Cell* referenced_cell = reinterpret_cast<Cell*>(
-            sheet_.GetCell(referenced_pos)
-        ))
-            referenced_cell->dependent_cells_.erase(this);
-
-    // Update referenced cells and insert this cell as dependent one
-    referenced_cells_ = updated_impl->GetReferencedCells();
-    for (const Position& referenced_pos : referenced_cells_)
-        if (Cell* referenced_cell = reinterpret_cast<Cell*>(
-            sheet_.GetCell(referenced_pos)
-        ))
-            referenced_cell->dependent_cells_.insert(this);
+    context_.precedents.ForEach(id_, [this](CellId referenced_id) {
+        context_.dependents.Remove(referenced_id, id_);
+    });
+    for (const auto& [context, range] : referenced_ranges_)
+        context->ranges.Erase(range, this);
+
+    LinkCellsGraph(updated_content);
+}
+
+void Cell::UnlinkCellsGraph(
+    const std::vector<CellId>& referenced_ids,
+    const std::vector<RangeReference>& referenced_ranges
+) {
+    for (CellId referenced_id : referenced_ids)
+        context_.dependents.Remove(referenced_id, id_);
+    for (const auto& [context, range] : referenced_ranges)
+        context->ranges.Erase(range, this);
+}
+
+void Cell::LinkCellsGraph(const Content& updated_content) {
+    // Update referenced cells and insert this cell as dependent one. Missing
+    // cells are created empty, so that setting them later drops this cache
+    const std::vector<Position> referenced_cells
+        = updated_content.GetReferencedCells();
+    for (const Position& referenced_pos : referenced_cells)
+        if (!context_.cells.Find(referenced_pos))
+            context_.sheet.SetCell(referenced_pos, {});
+
+    std::vector<CellId> referenced_ids = FindCellIds(referenced_cells);
+    for (CellId referenced_id : referenced_ids)
+        context_.dependents.Add(referenced_id, id_);
+    context_.precedents.Assign(id_, referenced_ids);
+
+    // Ranges are found by the position of a changed cell, so their missing
+    // cells are not created
+    referenced_ranges_ = updated_content.GetReferencedRanges();
+    for (const auto& [context, range] : referenced_ranges_)
+        context->ranges.Insert(range, this);
+}
+
+void Cell::Recalculate(const std::vector<const Cell*>& cells,
+                       size_t workers_count) {
+    const std::vector<const Cell*> sorted_cells = SortDirtyCells(cells);
+    if (workers_count <= 1u || sorted_cells.size() < MIN_PARALLEL_LEVEL_SIZE) {
+        Evaluate(sorted_cells, 1u);
+        return;
+    }
+
+    for (const auto& level : SplitDependencyLevels(sorted_cells))
+        Evaluate(level, workers_count);
+}
+
+std::vector<const Cell*> Cell::SortDirtyCells(
+    const std::vector<const Cell*>& cells
+) {
+    std::vector<const Cell*> sorted_cells;
+    std::unordered_set<const Cell*> visited_cells;
+
+    // Depth-first search with an explicit stack of (cell, precedents pushed).
+    // A cell is visited when its precedents are pushed and is sorted when it
+    // is back on the top after them.
+    std::vector<std::pair<const Cell*, bool>> stack;
+    for (const Cell* cell : cells) {
+        stack.emplace_back(cell, false);
+        while (!stack.empty()) {
+            const auto [current_cell, is_expanded] = stack.back();
+            if (is_expanded) {
+                sorted_cells.push_back(current_cell);
+                stack.pop_back();
+                continue;
+            }
+
+            if (
+                current_cell->IsCached()
+                || !visited_cells.insert(current_cell).second
+            ) {
+                stack.pop_back();
+                continue;
+            }
+
+            stack.back().second = true;
+            current_cell->ForEachPrecedent(
+                [&stack, &visited_cells](const Cell* referenced_cell) {
+                    if (
+                        !referenced_cell->IsCached()
+                        && visited_cells.count(referenced_cell) == 0u
+                    )
+                        stack.emplace_back(referenced_cell, false);
+                }
+            );
+        }
+    }
+
+    return sorted_cells;
+}
+
+std::vector<std::vector<const Cell*>> Cell::SplitDependencyLevels(
+    const std::vector<const Cell*>& sorted_cells
+) {
+    std::vector<std::vector<const Cell*>> levels;
+    std::unordered_map<const Cell*, size_t> cell_levels;
+    cell_levels.reserve(sorted_cells.size());
+
+    for (const Cell* cell : sorted_cells) {
+        // Referenced dirty cells are sorted before and already have a level
+        size_t level = 0u;
+        cell->ForEachPrecedent(
+            [&level, &cell_levels](const Cell* referenced_cell) {
+                const auto it = cell_levels.find(referenced_cell);
+                if (it != cell_levels.end())
+                    level = std::max(level, it->second + 1u);
+            }
+        );
+
+        cell_levels[cell] = level;
+        if (levels.size() == level)
+            levels.emplace_back();
+        levels[level].push_back(cell);
+    }
+
+    return levels;
+}
+
+void Cell::Evaluate(const std::vector<const Cell*>& cells,
+                    size_t workers_count) {
+    ForEachParallel(cells.size(), workers_count, [&cells](size_t i) {
+        ++cells[i]->context_.cache_statistics.misses;
+        cells[i]->content_.GetValue();
+        cells[i]->StoreValue();
+    });
+}
+
+void Cell::Load(const std::vector<Cell*>& cells,
+                std::vector<std::string> texts,
+                size_t workers_count) {
+    assert(cells.size() == texts.size());
+
+    // Cells are independent until linked, so parsing runs in parallel
+    ForEachParallel(cells.size(), workers_count, [&](size_t i) {
+        cells[i]->content_ = cells[i]->MakeContent(std::move(texts[i]));
+    });
+
+    Link(cells);
+}
+
+void Cell::Restore(const std::vector<Cell*>& cells, SnapshotReader& reader) {
+    for (Cell* cell : cells)
+        cell->content_ = cell->RestoreContent(reader);
+
+    Link(cells);
+}
+
+void Cell::Link(const std::vector<Cell*>& cells) {
+    for (Cell* cell : cells) {
+        cell->UpdateCellsGraph(cell->content_);
+        cell->StoreValue();
+    }
+
+    ValidateGraph(cells);
+}
+
+void Cell::Content::Save(SnapshotWriter& writer) const {
+    using Code = FormulaAST::Instruction::Code;
+
+    if (kind_ != ContentKind::Formula) {
+        writer.Write(kind_ == ContentKind::Empty
+                     ? ContentKind::Empty
+                     : ContentKind::Text);
+        if (kind_ != ContentKind::Empty)
+            writer.WriteString(text_.text);
+        return;
+    }
+
+    writer.Write(ContentKind::Formula);
+    writer.WriteString(formula_.formula->GetExpression());
+
+    const std::vector<FormulaAST::Instruction>& program
+        = formula_.formula->GetProgram();
+    writer.Write(static_cast<uint32_t>(program.size()));
+    for (const FormulaAST::Instruction& instruction : program) {
+        writer.Write(instruction.code);
+        if (instruction.code == Code::Number)
+            writer.Write(instruction.number);
+        else if (instruction.code == Code::Range)
+            writer.Write(instruction.range);
+        else if (
+            instruction.code == Code::Cell
+            || instruction.code == Code::CellArgument
+        )
+            writer.Write(instruction.cell);
+
+        if (
+            instruction.code == Code::Cell
+            || instruction.code == Code::CellArgument
+            || instruction.code == Code::Range
+        )
+            writer.Write(instruction.sheet);
+    }
+
+    // Sheets are written by name, so that they are found in the workbook
+    // the snapshot is loaded into
+    const std::vector<std::string>& sheets
+        = formula_.formula->GetReferencedSheets();
+    writer.Write(static_cast<uint32_t>(sheets.size()));
+    for (const std::string& sheet : sheets)
+        writer.WriteString(sheet);
+
+    // 0 - no cached value, 1 - number, 2 - error
+    const std::optional<FormulaInterface::Value>& cache = formula_.cache;
+    if (!cache) {
+        writer.Write(uint8_t{0});
+    } else if (std::holds_alternative<double>(*cache)) {
+        writer.Write(uint8_t{1});
+        writer.Write(std::get<double>(*cache));
+    } else {
+        writer.Write(uint8_t{2});
+        writer.Write(std::get<FormulaError>(*cache).GetCategory());
+    }
+}
+
+Cell::Content Cell::RestoreContent(SnapshotReader& reader) const {
+    using Code = FormulaAST::Instruction::Code;
+
+    switch (reader.Read<ContentKind>()) {
+        case ContentKind::Empty:
+            return Content();
+        case ContentKind::Text: {
+            const std::string_view text = reader.ReadString();
+            if (text.empty())
+                throw SnapshotException("empty text cell");
+            return Content(std::string(text));
+        } case ContentKind::Formula:
+            break;
+        default:
+            throw SnapshotException("invalid cell kind");
+    }
+
+    std::string expression(reader.ReadString());
+    std::vector<FormulaAST::Instruction> program;
+    const size_t program_size = reader.Read<uint32_t>();
+    for (size_t i = 0; i < program_size; ++i) {
+        const Code code = reader.Read<Code>();
+        if (code == Code::Number) {
+            program.emplace_back(reader.Read<double>());
+        } else if (code == Code::Cell || code == Code::CellArgument) {
+            const Position pos = reader.Read<Position>();
+            program.emplace_back(
+                code, pos, reader.Read<FormulaAST::SheetIndex>()
+            );
+        } else if (code == Code::Range) {
+            const Range range = reader.Read<Range>();
+            program.emplace_back(range, reader.Read<FormulaAST::SheetIndex>());
+        } else {
+            program.emplace_back(code);
+        }
+    }
+
+    std::vector<std::string> sheets;
+    const size_t sheets_count = reader.Read<uint32_t>();
+    for (size_t i = 0; i < sheets_count; ++i)
+        sheets.emplace_back(reader.ReadString());
+
+    std::optional<FormulaInterface::Value> cache;
+    switch (reader.Read<uint8_t>()) {
+        case 0:
+            break;
+        case 1:
+            cache = reader.Read<double>();
+            break;
+        case 2: {
+            const auto category = reader.Read<FormulaError::Category>();
+            if (
+                category < FormulaError::Category::Ref
+                || category > FormulaError::Category::Div0
+            )
+                throw SnapshotException("invalid formula error");
+            cache = FormulaError(category);
+            break;
+        } default:
+            throw SnapshotException("invalid formula cache");
+    }
+
+    if (expression.empty())
+        throw SnapshotException("empty formula expression");
+    try {
+        return Content(
+            context_,
+            RestoreFormula(
+                std::move(expression),
+                std::move(program),
+                std::move(sheets)
+            ),
+            std::move(cache)
+        );
+    } catch (const FormulaException& exc) {
+        throw SnapshotException(exc.what());
+    }
+}
+
+void Cell::Update(const std::vector<Cell*>& cells,
+                  std::vector<std::string> texts,
+                  size_t workers_count) {
+    assert(cells.size() == texts.size());
+
+    std::vector<Content> updated_contents(cells.size());
+    ForEachParallel(cells.size(), workers_count, [&](size_t i) {
+        updated_contents[i] = cells[i]->MakeContent(std::move(texts[i]));
+    });
+
+    // Whole batch is validated with the new references swapped in, no
+    // placeholders are created yet and the swap is simply undone on a cycle
+    std::vector<std::vector<CellId>> replaced_references(cells.size());
+    std::vector<std::vector<RangeReference>> replaced_ranges(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const CellId id = cells[i]->id_;
+        replaced_references[i] = cells[i]->context_.precedents.Get(id);
+        cells[i]->context_.precedents.Assign(
+            id,
+            cells[i]->FindCellIds(updated_contents[i].GetReferencedCells())
+        );
+        replaced_ranges[i] = std::exchange(
+            cells[i]->referenced_ranges_,
+            updated_contents[i].GetReferencedRanges()
+        );
+    }
+
+    const auto& restore_references = [&](size_t i) {
+        cells[i]->context_.precedents.Assign(
+            cells[i]->id_,
+            replaced_references[i]
+        );
+        cells[i]->referenced_ranges_ = std::move(replaced_ranges[i]);
+    };
+
+    try {
+        ValidateGraph(cells);
+    } catch (...) {
+        for (size_t i = 0; i < cells.size(); ++i)
+            restore_references(i);
+        throw;
+    }
+
+    // Caches are dropped by one walk from all the cells and the replaced
+    // edges of all the cells are removed before the new ones are added, the
+    // precedents hold the new references already
+    DropDependentCache(cells);
+    for (size_t i = 0; i < cells.size(); ++i)
+        cells[i]->UnlinkCellsGraph(
+            replaced_references[i], replaced_ranges[i]
+        );
+    for (size_t i = 0; i < cells.size(); ++i) {
+        Cell* cell = cells[i];
+        cell->LinkCellsGraph(updated_contents[i]);
+        cell->content_ = std::move(updated_contents[i]);
+        cell->StoreValue();
+    }
+}
+
+void Cell::ValidateGraph(const std::vector<Cell*>& cells) {
+    // Depth-first search marking cells on the current path with the first
+    // epoch and the finished cells with the second one
+    const size_t visiting_epoch = ++validation_epoch;
+    const size_t visited_epoch = ++validation_epoch;
+
+    // Stack of (cell, precedents pushed) as in SortDirtyCells()
+    std::vector<std::pair<const Cell*, bool>> stack;
+    for (const Cell* cell : cells) {
+        stack.emplace_back(cell, false);
+        while (!stack.empty()) {
+            const auto [current_cell, is_expanded] = stack.back();
+            if (is_expanded) {
+                current_cell->validation_epoch_ = visited_epoch;
+                stack.pop_back();
+                continue;
+            }
+
+            if (current_cell->validation_epoch_ == visited_epoch) {
+                stack.pop_back();
+                continue;
+            }
+
+            current_cell->validation_epoch_ = visiting_epoch;
+            stack.back().second = true;
+            current_cell->ForEachPrecedent(
+                [&stack, visiting_epoch, visited_epoch](
+                    const Cell* referenced_cell
+                ) {
+                    if (referenced_cell->validation_epoch_ == visiting_epoch)
+                        throw CircularDependencyException(
+                            "circular dependency"
+                        );
+
+                    if (referenced_cell->validation_epoch_ != visited_epoch)
+                        stack.emplace_back(referenced_cell, false);
+                }
+            );
+        }
+    }
 }
\ No newline at end of file
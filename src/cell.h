@@ -1,142 +1,488 @@
 #pragma once
 
+#include "adjacency.h"
 #include "common.h"
 #include "formula.h"
+#include "range_index.h"
+#include "snapshot.h"
+#include "value_store.h"
 
+#include <atomic>
 #include <iostream>
 #include <optional>
 #include <string>
-#include <unordered_set>
+
+class CellStorage;
+class Workbook;
 
 class Cell final : public CellInterface {
-    class Impl {
-    public:
-        virtual ~Impl() = default;
-        virtual CellInterface::Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
-        virtual void DropCache() = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
+public:
+    // Formula values cache usage shared by all cells of a sheet, updated
+    // concurrently by the parallel recalculation
+    struct CacheStatistics {
+        std::atomic<size_t> hits = {0};
+        std::atomic<size_t> misses = {0};
+
+        // Caches dropped by the edits of the referenced cells
+        std::atomic<size_t> invalidations = {0};
     };
 
-    class EmptyImpl final : public Impl {
-    public:
-        inline CellInterface::Value GetValue() const override {
-            return {};
+    // State shared by all the cells of a sheet
+    struct Context {
+        Context(SheetInterface& sheet, const CellStorage& cells)
+            : sheet(sheet)
+            , cells(cells) {
         }
 
-        inline std::string GetText() const override {
-            return {};
-        }
+        SheetInterface& sheet;
+        const CellStorage& cells;
+        mutable CacheStatistics cache_statistics;
+        FormulaTable formulas;
+        RangeIndex ranges;
+        ValueStore values;
+
+        // Cells referred to by the formula of each cell and the cells with
+        // formulas referring to each cell, ranges are kept in ranges only
+        AdjacencyLists precedents;
+        AdjacencyLists dependents;
+
+        // Workbook of the sheet and the name formulas of the other sheets
+        // refer to it by, a standalone sheet has neither
+        Workbook* workbook = nullptr;
+        std::string name;
+    };
 
-        inline void DropCache() override {}
+    // Range referred to by a formula with the context of its sheet. Cells of
+    // the other sheets are referred to as ranges of one cell, so that the
+    // formulas are found by the range index of the sheet the cell is on.
+    struct RangeReference {
+        Context* context;
+        Range range;
+    };
 
-        inline std::vector<Position> GetReferencedCells() const override {
-            return {};
-        }
+    // Visible value of the cell referring to the cell text instead of copying
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+private:
+    using RangeNumber = std::optional<FormulaInterface::Value>;
+
+    // Kind of the cell content. Texts of numbers are told apart from the
+    // other texts, so that their numbers are parsed once. The first three
+    // kinds are written to snapshots, numbers are written as texts.
+    enum class ContentKind : uint8_t {
+        Empty,
+        Text,
+        Formula,
+        Number,
     };
 
-    class TextImpl final : public Impl {
+    // Content of the cell kept inline as a tagged union, so that reading it
+    // takes neither a virtual call nor a separate allocation. Short texts
+    // stay inside the cell too, by the small string optimization.
+    class Content {
     public:
-        TextImpl(std::string text) : content_(std::move(text)) {}
+        Content() {}
+
+        // Text has to be not empty, it is parsed as a number once here
+        explicit Content(std::string text);
+
+        // Throws FormulaException if the formula refers to a sheet missing in
+        // the workbook
+        Content(Context& context,
+                std::unique_ptr<FormulaInterface> formula,
+                std::optional<FormulaInterface::Value> cache = std::nullopt);
+
+        Content(Content&& other) noexcept;
+        Content& operator=(Content&& other) noexcept;
 
-        inline CellInterface::Value GetValue() const override {
-            return content_.front() == ESCAPE_SIGN
-                   ? content_.substr(1)
-                   : content_;
+        ~Content() {
+            Destroy();
         }
 
-        inline std::string GetText() const override {
-            return content_;
+        inline CellInterface::Value GetValue() const {
+            if (kind_ == ContentKind::Formula) {
+                const FormulaInterface::Value result = GetNumber();
+                return std::holds_alternative<double>(result)
+                       ? CellInterface::Value(std::get<double>(result))
+                       : CellInterface::Value(std::get<FormulaError>(result));
+            }
+            if (kind_ == ContentKind::Empty)
+                return {};
+
+            return std::string(GetTextValue());
         }
 
-        inline void DropCache() override {}
+        inline std::string GetText() const {
+            if (kind_ == ContentKind::Formula)
+                return FORMULA_SIGN + formula_.formula->GetExpression();
+            if (kind_ == ContentKind::Empty)
+                return {};
 
-        inline std::vector<Position> GetReferencedCells() const override {
-            return {};
+            return text_.text;
         }
 
-    private:
-        std::string content_;
-    };
+        inline ValueView GetValueView() const {
+            if (kind_ == ContentKind::Formula) {
+                const FormulaInterface::Value result = GetNumber();
+                return std::holds_alternative<double>(result)
+                       ? ValueView(std::get<double>(result))
+                       : ValueView(std::get<FormulaError>(result));
+            }
+            if (kind_ == ContentKind::Empty)
+                return std::string_view();
+
+            return GetTextValue();
+        }
 
-    class FormulaImpl final : public Impl {
-    public:
-        FormulaImpl(const SheetInterface& sheet, std::string text)
-            : sheet_(sheet)
-            , formula_(ParseFormula(text)) {
+        inline void AppendText(std::string& output) const {
+            if (kind_ == ContentKind::Formula) {
+                output.push_back(FORMULA_SIGN);
+                output.append(formula_.formula->GetExpression());
+            } else if (kind_ != ContentKind::Empty) {
+                output.append(text_.text);
+            }
         }
 
-        inline CellInterface::Value GetValue() const override {
-            const FormulaInterface::Value& result = (cache_ != std::nullopt)
-                ? *cache_ : formula_->Evaluate(sheet_);
-            return std::holds_alternative<double>(result)
-                   ? CellInterface::Value(std::get<double>(result))
-                   : CellInterface::Value(std::get<FormulaError>(result));
+        inline bool IsEmpty() const {
+            return kind_ == ContentKind::Empty;
         }
 
-        inline std::string GetText() const override {
-            return FORMULA_SIGN + formula_->GetExpression();
+        inline bool IsCached() const {
+            return kind_ != ContentKind::Formula || formula_.cache;
         }
 
-        inline void DropCache() override {
-            cache_ = std::nullopt;
+        inline void DropCache() {
+            if (kind_ == ContentKind::Formula)
+                formula_.cache = std::nullopt;
         }
 
-        inline std::vector<Position> GetReferencedCells() const override {
-            return formula_->GetReferencedCells();
+        inline std::vector<Position> GetReferencedCells() const {
+            if (kind_ == ContentKind::Formula)
+                return formula_.formula->GetReferencedCells();
+            return {};
+        }
+
+        // Moves the formula with its cell, see FormulaInterface::Move()
+        inline bool Move(Position offset) {
+            return kind_ != ContentKind::Formula
+                   || formula_.formula->Move(offset);
+        }
+
+        // Ranges of the formula sheet followed by the cells and the ranges
+        // of the other sheets
+        std::vector<RangeReference> GetReferencedRanges() const;
+
+        // Value of the cell read by formulas. Formula is evaluated on the
+        // first read only, the result is kept until DropCache() is called by
+        // one of the referenced cells.
+        inline FormulaInterface::Value GetNumber() const {
+            switch (kind_) {
+                case ContentKind::Formula:
+                    if (!formula_.cache)
+                        formula_.cache = Evaluate();
+                    return *formula_.cache;
+                case ContentKind::Number:
+                    return text_.number;
+                case ContentKind::Text:
+                    return FormulaError(FormulaError::Category::Value);
+                default:
+                    return .0;
+            }
         }
 
+        // Value of the cell read by the functions of ranges, there is none
+        // for the cells the functions skip: empty and not numeric texts
+        inline RangeNumber GetRangeNumber() const {
+            if (kind_ == ContentKind::Formula || kind_ == ContentKind::Number)
+                return GetNumber();
+            return std::nullopt;
+        }
+
+        // Writes formulas with the compiled program and the cached value, so
+        // that they are restored without parsing
+        void Save(SnapshotWriter& writer) const;
+
     private:
-        const SheetInterface& sheet_;
-        std::unique_ptr<FormulaInterface> formula_;
-        std::optional<FormulaInterface::Value> cache_;
+        struct TextData {
+            std::string text;
+            double number;
+        };
+
+        struct FormulaData {
+            Context* context;
+            std::unique_ptr<FormulaInterface> formula;
+            mutable std::optional<FormulaInterface::Value> cache;
+
+            // Contexts of the other sheets by the formula sheet indices less
+            // one, the formulas of a single sheet have none
+            std::unique_ptr<const std::vector<Context*>> sheets;
+        };
+
+        ContentKind kind_ = ContentKind::Empty;
+        union {
+            // Text and number cells
+            TextData text_;
+            FormulaData formula_;
+        };
+
+        // Text without the escape sign
+        inline std::string_view GetTextValue() const {
+            return std::string_view(text_.text).substr(
+                text_.text.front() == ESCAPE_SIGN ? 1u : 0u
+            );
+        }
+
+        FormulaInterface::Value Evaluate() const;
+
+        inline const Context& GetSheetContext(
+            FormulaAST::SheetIndex sheet
+        ) const {
+            return sheet == 0u
+                   ? *formula_.context
+                   : *(*formula_.sheets)[sheet - 1u];
+        }
+
+        // Destroys the active member leaving the content empty
+        void Destroy();
     };
 
 public:
-    Cell(SheetInterface& sheet) : sheet_(sheet) {};
+    Cell(Context& context, Position pos, CellId id)
+        : context_(context)
+        , pos_(pos)
+        , id_(id) {
+    };
 
     ~Cell() = default;
 
+    // Evaluates the cell with all its dirty referenced cells in dependency
+    // order, so that the formulas never recurse into each other
     inline Value GetValue() const override {
-        return impl_->GetValue();
+        Actualize();
+        return content_.GetValue();
     }
 
     inline std::string GetText() const override {
-        return impl_->GetText();
+        return content_.GetText();
+    }
+
+    inline ValueView GetValueView() const {
+        Actualize();
+        return content_.GetValueView();
+    }
+
+    inline void AppendText(std::string& output) const {
+        content_.AppendText(output);
     }
 
     inline std::vector<Position> GetReferencedCells() const override {
-        return referenced_cells_;
+        return content_.GetReferencedCells();
+    }
+
+    // Position formulas of the cell are relative to
+    inline Position GetPosition() const {
+        return pos_;
+    }
+
+    inline CellId GetId() const {
+        return id_;
+    }
+
+    inline SheetInterface& GetSheet() const {
+        return context_.sheet;
+    }
+
+    // Cell is moved by the storage: a released cell is reused at a new
+    // position, the cells of the shifted rows and columns keep their content
+    inline void SetPosition(Position pos) {
+        pos_ = pos;
+    }
+
+    // Ranges referred to by the formula of the cell, on any sheet
+    inline const std::vector<RangeReference>& GetReferencedRanges() const {
+        return referenced_ranges_;
+    }
+
+    // Moves the formula of the cell shifted by the storage by offset together
+    // with its references, so that it keeps its cache, and stores the value
+    // at the new position. Returns false leaving the formula as is if it is
+    // not moved this way, the shifted text has to be set again then.
+    bool Move(Position offset);
+
+    // Cell has no text and is not printed
+    inline bool IsEmpty() const {
+        return content_.IsEmpty();
+    }
+
+    // Cell stays in the dependency graph if other cells refer to it
+    inline bool IsReferenced() const {
+        return !context_.dependents.IsEmpty(id_);
     }
 
     inline void Clear() {
-        impl_ = std::make_unique<EmptyImpl>();
+        Set({});
     }
 
     void Set(std::string text) override;
 
+    inline bool IsCached() const {
+        return content_.IsCached();
+    }
+
+    // Removes the cell from the range indexes of the sheets it refers to,
+    // before it is destroyed with the rest of its sheet
+    void UnlinkRanges();
+
+    // Drops the cache of the formula and of the formulas depending on it,
+    // e.g. when a sheet it refers to is replaced as a whole
+    void Invalidate();
+
+    // Sets texts of the passed new cells at once: texts are parsed on
+    // workers_count threads and the cells are linked into the graph without
+    // per cell validation. Throws CircularDependencyException if the loaded
+    // cells form a cycle, the cells are left linked in that case.
+    static void Load(const std::vector<Cell*>& cells,
+                     std::vector<std::string> texts,
+                     size_t workers_count = 1u);
+
+    // Sets texts of the passed distinct cells as one edit: all the texts are
+    // parsed and checked for cycles before any cell is changed, the dependent
+    // caches are dropped once. Throws FormulaException or
+    // CircularDependencyException leaving all the cells unchanged.
+    static void Update(const std::vector<Cell*>& cells,
+                       std::vector<std::string> texts,
+                       size_t workers_count = 1u);
+
+    // Writes the cell content to the snapshot, formulas are written compiled
+    // with their cached values
+    inline void Save(SnapshotWriter& writer) const {
+        content_.Save(writer);
+    }
+
+    // Reads the content of the passed new cells written by Save() and links
+    // them into the graph. Throws SnapshotException if the snapshot is
+    // invalid and CircularDependencyException if the cells form a cycle.
+    static void Restore(const std::vector<Cell*>& cells,
+                        SnapshotReader& reader);
+
+    // Evaluates passed cells and all the dirty cells they refer to. Cells of
+    // the same dependency level are split between workers_count threads
+    static void Recalculate(const std::vector<const Cell*>& cells,
+                            size_t workers_count = 1u);
+
 private:
-    SheetInterface& sheet_;
-    std::unique_ptr<Impl> impl_ = std::make_unique<EmptyImpl>();
-    std::vector<Position> referenced_cells_;
-    std::unordered_set<Cell*> dependent_cells_;
+    Context& context_;
+    Position pos_;
+    CellId id_;
+    Content content_;
+    std::vector<RangeReference> referenced_ranges_;
+
+    // Last validation pass this cell was visited by
+    mutable size_t validation_epoch_ = 0u;
+
+    inline void Actualize() const {
+        if (content_.IsCached())
+            ++context_.cache_statistics.hits;
+        else
+            Recalculate({this});
+    }
 
-    inline void Validate(const std::unique_ptr<Impl>& updated_impl) const {
-        std::unordered_set<const Cell*> validated_cells = {};
-        Validate(updated_impl->GetReferencedCells(), validated_cells);
+    inline FormulaInterface::Value GetNumber() const {
+        Actualize();
+        return content_.GetNumber();
     }
 
-    inline void DropDependentCache() {
-        std::unordered_set<const Cell*> dropped_cache_cells = {};
-        DropDependentCache(dropped_cache_cells);
+    // Copies the current value of the cell into the value store
+    void StoreValue() const;
+
+    inline void DropCache() {
+        content_.DropCache();
+        context_.values.Set(pos_, ValueStore::Tag::Dirty);
+    }
+
+    // Value of the referenced cell read by formulas from the value store,
+    // missing cells are zero
+    static FormulaInterface::Value GetReferencedNumber(const Context& context,
+                                                       Position pos);
+
+    // Appends numbers of the range cells read by the functions from the
+    // value store, returns the error of a formula cell if there is one
+    static std::optional<FormulaError> GetRangeNumbers(
+        const Context& context,
+        Range range,
+        std::vector<double>& numbers
+    );
+
+    Content MakeContent(std::string text) const;
+
+    Content RestoreContent(SnapshotReader& reader) const;
+
+    inline void Validate(const Content& updated_content) const {
+        Validate(
+            updated_content.GetReferencedCells(),
+            updated_content.GetReferencedRanges()
+        );
     }
 
+    // Throws CircularDependencyException if this cell is reachable from the
+    // passed references
     void Validate(const std::vector<Position>& referenced_cells,
-                  std::unordered_set<const Cell*>& validated_cells) const;
+                  const std::vector<RangeReference>& referenced_ranges) const;
+
+    // Calls fn(cell) for the existing cells this one refers to directly and
+    // through the ranges, on any sheet
+    template <typename Fn>
+    void ForEachPrecedent(Fn fn) const;
+
+    // Calls fn(cell) for the cells referring to this one directly and
+    // through the ranges, on any sheet
+    template <typename Fn>
+    void ForEachDependent(Fn fn) const;
+
+    // Drops caches of all the cells depending on this one, the count of
+    // dropped caches is added to the cache statistics
+    void DropDependentCache();
 
-    void DropDependentCache(
-        std::unordered_set<const Cell*>& dropped_cache_cells
+    // Drops caches of all the cells depending on the passed ones in one walk
+    static void DropDependentCache(const std::vector<Cell*>& cells);
+
+    // Walks the dependents of the cells of the invalidation stack
+    static void DropStackedDependentCache();
+
+    // Ids of the existing cells at the positions without repeats
+    std::vector<CellId> FindCellIds(
+        const std::vector<Position>& positions
+    ) const;
+
+    void UpdateCellsGraph(const Content& updated_content);
+
+    // Removes the edges of this cell to the passed references
+    void UnlinkCellsGraph(const std::vector<CellId>& referenced_ids,
+                          const std::vector<RangeReference>& referenced_ranges);
+
+    // Adds the edges of this cell to the references of the content, the
+    // missing referenced cells are created
+    void LinkCellsGraph(const Content& updated_content);
+
+    // Returns dirty cells reachable from the passed ones, each one placed
+    // after all the cells it refers to
+    static std::vector<const Cell*> SortDirtyCells(
+        const std::vector<const Cell*>& cells
+    );
+
+    // Groups sorted dirty cells so that each one refers only to the cells
+    // from the previous groups
+    static std::vector<std::vector<const Cell*>> SplitDependencyLevels(
+        const std::vector<const Cell*>& sorted_cells
     );
 
-    void UpdateCellsGraph(const std::unique_ptr<Impl>& updated_impl);
+    static void Evaluate(const std::vector<const Cell*>& cells,
+                         size_t workers_count);
+
+    // Links the new cells into the graph and validates it at once
+    static void Link(const std::vector<Cell*>& cells);
+
+    // Throws CircularDependencyException if the graph reachable from the
+    // passed cells has a cycle, missing cells are skipped
+    static void ValidateGraph(const std::vector<Cell*>& cells);
 };
@@ -10,7 +10,9 @@
 #include <stdexcept>
 #include <string_view>
 #include <string>
+#include <utility>
 #include <variant>
+#include <vector>
 
 // Позиция ячейки. Индексация с нуля.
 struct Position {
@@ -47,6 +49,32 @@ struct Size {
     }
 };
 
+// Прямоугольный диапазон ячеек, например A1:B3. Левая верхняя и правая нижняя
+// ячейки входят в диапазон.
+struct Range {
+    Position first;
+    Position last;
+
+    inline bool operator==(Range rhs) const {
+        return first == rhs.first && last == rhs.last;
+    }
+
+    inline bool IsValid() const {
+        return first.IsValid() && last.IsValid()
+               && first.row <= last.row && first.col <= last.col;
+    }
+
+    inline bool Contains(Position pos) const {
+        return first.row <= pos.row && pos.row <= last.row
+               && first.col <= pos.col && pos.col <= last.col;
+    }
+
+    std::string ToString() const;
+
+    // Разбирает диапазон вида A1:B3, углы могут быть указаны в любом порядке.
+    static Range FromString(std::string_view str);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -83,6 +111,9 @@ private:
     Category category_;
 };
 
+// Выводит текст ошибки, например #DIV/0!.
+std::ostream& operator<<(std::ostream& output, FormulaError fe);
+
 // Исключение, выбрасываемое при попытке задать синтаксически некорректную
 // формулу
 class FormulaException : public std::runtime_error {
@@ -157,6 +188,13 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое нескольких ячеек за одну операцию. Если позиция
+    // встречается несколько раз, применяется последний текст. Проверка на
+    // циклические зависимости и сброс кэша зависимых ячеек выполняются один
+    // раз для всех изменений. Если хотя бы одно изменение некорректно, таблица
+    // остаётся без изменений.
+    virtual void SetCells(std::vector<std::pair<Position, std::string>> cells) = 0;
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -167,6 +205,19 @@ public:
     // объект с пустым текстом.
     virtual void ClearCell(Position pos) = 0;
 
+    // Вставляет count пустых строк/столбцов перед строкой/столбцом before.
+    // Ячейки и ссылки на них в формулах сдвигаются, диапазоны, пересекающие
+    // место вставки, расширяются. Бросает TableTooBigException, если ячейка
+    // или ссылка выйдет за пределы таблицы; таблица при этом не меняется.
+    virtual void InsertRows(int before, int count = 1) = 0;
+    virtual void InsertCols(int before, int count = 1) = 0;
+
+    // Удаляет count строк/столбцов, начиная с first. Ссылки на удалённые
+    // ячейки в формулах заменяются на #REF!, диапазоны сужаются, а полностью
+    // удалённые также заменяются на #REF!.
+    virtual void DeleteRows(int first, int count = 1) = 0;
+    virtual void DeleteCols(int first, int count = 1) = 0;
+
     // Вычисляет размер области, которая участвует в печати.
     // Определяется как ограничивающий прямоугольник всех ячеек с непустым
     // текстом.
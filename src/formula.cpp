@@ -2,68 +2,151 @@
 
 #include "FormulaAST.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
 #include <sstream>
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
-class Formula : public FormulaInterface {
-    class ValueGetter {
-    public:
-        ValueGetter(double& value) : value_(value) {}
+class CellValueGetter {
+public:
+    inline FormulaInterface::Value operator()(const double value) const {
+        return value;
+    }
 
-        inline void operator()(const double value) {
-            value_ = value;
-        }
+    inline FormulaInterface::Value operator()(const std::string& text) const {
+        return ParseNumber(text);
+    }
+
+    inline FormulaInterface::Value operator()(const FormulaError& error) const {
+        return error;
+    }
+};
+
+// Formula evaluated through the sheet interface has no workbook, so the
+// references to the other sheets are not found
+FormulaInterface::Value GetCellValue(const SheetInterface& sheet,
+                                     FormulaAST::SheetIndex sheet_index,
+                                     Position pos) {
+    if (sheet_index != 0u || !pos.IsValid())
+        return FormulaError(FormulaError::Category::Ref);
+
+    // Escaped empty text has the same empty value as a cell without content,
+    // so the two are told apart by the text
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (!cell || cell->GetText().empty())
+        return .0;
+
+    return std::visit(CellValueGetter(), cell->GetValue());
+}
+
+// Appends the numbers of the range cells read through the sheet interface
+std::optional<FormulaError> GetRangeValues(const SheetInterface& sheet,
+                                           FormulaAST::SheetIndex sheet_index,
+                                           Range range,
+                                           std::vector<double>& numbers) {
+    if (sheet_index != 0u)
+        return FormulaError(FormulaError::Category::Ref);
+
+    for (int row = range.first.row; row <= range.last.row; ++row)
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = sheet.GetCell({row, col});
+            if (!cell)
+                continue;
 
-        inline void operator()(const std::string& text) {
-            try {
-                value_ = std::stod(text);
-            } catch (const std::invalid_argument&) {
-                throw FormulaError(FormulaError::Category::Value);
+            const CellInterface::Value value = cell->GetValue();
+            if (const auto* error = std::get_if<FormulaError>(&value))
+                return *error;
+            if (const auto* number = std::get_if<double>(&value)) {
+                numbers.push_back(*number);
+                continue;
             }
-        }
 
-        inline void operator()(const FormulaError& error) {
-            throw error;
+            // Empty and not numeric text cells are skipped
+            const std::string& text = std::get<std::string>(value);
+            if (text.empty())
+                continue;
+
+            const FormulaInterface::Value text_number = ParseNumber(text);
+            if (const auto* number = std::get_if<double>(&text_number))
+                numbers.push_back(*number);
         }
 
-    private:
-        double& value_;
-    };
+    return std::nullopt;
+}
+
+inline Position Translate(Position pos, Position anchor) {
+    return {anchor.row + pos.row, anchor.col + pos.col};
+}
+
+inline Range Translate(Range range, Position anchor) {
+    return {Translate(range.first, anchor), Translate(range.last, anchor)};
+}
+
+// Ranges of the formula without repetitions in the order of the expression
+std::vector<Range> GetUniqueRanges(const FormulaAST& ast) {
+    std::vector<Range> ranges;
+    for (const Range& range : ast.GetRanges())
+        if (std::find(ranges.begin(), ranges.end(), range) == ranges.end())
+            ranges.push_back(range);
+
+    return ranges;
+}
+
+// Shifts the references of the program by anchor
+void TranslateProgram(std::vector<FormulaAST::Instruction>& program,
+                      Position anchor) {
+    using Code = FormulaAST::Instruction::Code;
+
+    for (FormulaAST::Instruction& instruction : program)
+        if (
+            instruction.code == Code::Cell
+            || instruction.code == Code::CellArgument
+        )
+            instruction.cell = Translate(instruction.cell, anchor);
+        else if (instruction.code == Code::Range)
+            instruction.range = Translate(instruction.range, anchor);
+}
 
+class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression)
         : ast_(ParseFormulaAST(expression)) {
     }
 
+    // Restored formula has no expression tree, so the text is kept instead
+    Formula(std::string expression, FormulaAST ast)
+        : ast_(std::move(ast))
+        , expression_(std::move(expression)) {
+    }
+
     Value Evaluate(const SheetInterface& sheet) const override {
-        const FormulaAST::ValueGetter& get_value = [&sheet](Position pos) {
-            if (!pos.IsValid())
-                throw FormulaError(FormulaError::Category::Ref);
+        return ast_.Execute(
+            [&sheet](FormulaAST::SheetIndex sheet_index, Position pos) {
+                return GetCellValue(sheet, sheet_index, pos);
+            },
+            [&sheet](FormulaAST::SheetIndex sheet_index,
+                     Range range,
+                     std::vector<double>& numbers) {
+                return GetRangeValues(sheet, sheet_index, range, numbers);
+            }
+        );
+    }
 
-            const CellInterface* cell = sheet.GetCell(pos);
-            if (!cell)
-                return .0;
-
-            double value = {};
-            const auto& cell_value = cell->GetValue();
-            std::visit(ValueGetter(value), cell_value);
-            return value;
-        };
-
-        try {
-            return ast_.Execute(get_value);
-        } catch (const FormulaError& formula_error) {
-            return formula_error;
-        }
+    Value Evaluate(const FormulaAST::ValueGetter& get_value,
+                   const FormulaAST::RangeGetter& get_range) const override {
+        return ast_.Execute(get_value, get_range);
     }
 
     std::string GetExpression() const override {
+        if (!expression_.empty())
+            return expression_;
+
         std::stringstream ss;
         ast_.PrintFormula(ss);
         return ss.str();
@@ -74,11 +157,300 @@ public:
         return {referenced_cells.begin(), referenced_cells.end()};
     }
 
+    inline std::vector<Range> GetReferencedRanges() const override {
+        return GetUniqueRanges(ast_);
+    }
+
+    inline const std::vector<std::string>& GetReferencedSheets()
+        const override {
+        return ast_.GetSheets();
+    }
+
+    inline std::vector<FormulaAST::SheetRange> GetSheetRanges()
+        const override {
+        return ast_.GetSheetRanges();
+    }
+
+    inline std::vector<FormulaAST::Instruction> GetProgram() const override {
+        return ast_.GetProgram();
+    }
+
+    // References of the tree are absolute
+    inline bool Move(Position) override {
+        return false;
+    }
+
 private:
     FormulaAST ast_;
+    std::string expression_;
 };
 }  // namespace
 
+// Compiled formula with the cells relative to the formula cell
+struct FormulaShape {
+    // Cell or range reference of the printed expression
+    struct Reference {
+        Range range;
+        bool is_range;
+    };
+
+    std::vector<FormulaAST::Instruction> program;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    std::vector<std::string> sheets;
+    std::vector<FormulaAST::SheetRange> sheet_ranges;
+
+    // Printed expression split at the references, the sheet names of the
+    // references end the parts before them
+    std::vector<std::string> expression_parts;
+    std::vector<Reference> expression_references;
+};
+
+namespace {
+class SharedFormula : public FormulaInterface {
+public:
+    SharedFormula(std::shared_ptr<const FormulaShape> shape, Position anchor)
+        : shape_(std::move(shape))
+        , anchor_(anchor) {
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return Evaluate(
+            [&sheet](FormulaAST::SheetIndex sheet_index, Position pos) {
+                return GetCellValue(sheet, sheet_index, pos);
+            },
+            [&sheet](FormulaAST::SheetIndex sheet_index,
+                     Range range,
+                     std::vector<double>& numbers) {
+                return GetRangeValues(sheet, sheet_index, range, numbers);
+            }
+        );
+    }
+
+    Value Evaluate(const FormulaAST::ValueGetter& get_value,
+                   const FormulaAST::RangeGetter& get_range) const override {
+        return FormulaAST::Execute(
+            shape_->program, get_value, get_range, anchor_
+        );
+    }
+
+    std::string GetExpression() const override {
+        std::string expression = shape_->expression_parts.front();
+        for (size_t i = 0; i < shape_->expression_references.size(); ++i) {
+            const auto& [range, is_range] = shape_->expression_references[i];
+            expression += is_range
+                          ? Translate(range, anchor_).ToString()
+                          : Translate(range.first, anchor_).ToString();
+            expression += shape_->expression_parts[i + 1];
+        }
+
+        return expression;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        std::vector<Position> referenced_cells;
+        referenced_cells.reserve(shape_->cells.size());
+        for (const Position& pos : shape_->cells)
+            referenced_cells.push_back(Translate(pos, anchor_));
+
+        return referenced_cells;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        std::vector<Range> referenced_ranges;
+        referenced_ranges.reserve(shape_->ranges.size());
+        for (const Range& range : shape_->ranges)
+            referenced_ranges.push_back(Translate(range, anchor_));
+
+        return referenced_ranges;
+    }
+
+    const std::vector<std::string>& GetReferencedSheets() const override {
+        return shape_->sheets;
+    }
+
+    std::vector<FormulaAST::SheetRange> GetSheetRanges() const override {
+        std::vector<FormulaAST::SheetRange> sheet_ranges = shape_->sheet_ranges;
+        for (FormulaAST::SheetRange& sheet_range : sheet_ranges)
+            sheet_range.range = Translate(sheet_range.range, anchor_);
+
+        return sheet_ranges;
+    }
+
+    std::vector<FormulaAST::Instruction> GetProgram() const override {
+        std::vector<FormulaAST::Instruction> program = shape_->program;
+        TranslateProgram(program, anchor_);
+        return program;
+    }
+
+    // Shape is shared as is, only the anchor moves. References to the other
+    // sheets do not move with the cell, so they would change the shape.
+    bool Move(Position offset) override {
+        if (!shape_->sheets.empty())
+            return false;
+
+        anchor_ = Translate(anchor_, offset);
+        return true;
+    }
+
+private:
+    std::shared_ptr<const FormulaShape> shape_;
+    Position anchor_;
+};
+
+// Parses the expression once and shifts its cells to be relative to anchor
+std::shared_ptr<const FormulaShape> MakeFormulaShape(
+    const std::string& expression,
+    Position anchor
+) {
+    const FormulaAST ast = ParseFormulaAST(expression);
+    const Position origin = {-anchor.row, -anchor.col};
+
+    auto shape = std::make_shared<FormulaShape>();
+    shape->program = ast.GetProgram();
+    TranslateProgram(shape->program, origin);
+    for (const Position& pos : ast.GetCells())
+        shape->cells.push_back(Translate(pos, origin));
+    for (const Range& range : GetUniqueRanges(ast))
+        shape->ranges.push_back(Translate(range, origin));
+    shape->sheets = ast.GetSheets();
+    for (const auto& [sheet, range] : ast.GetSheetRanges())
+        shape->sheet_ranges.push_back({sheet, Translate(range, origin)});
+
+    // Printed expression has no spaces, so its tokens are joined back as is
+    std::ostringstream printed;
+    ast.PrintFormula(printed);
+    shape->expression_parts.emplace_back();
+    TokenizeFormula(
+        printed.str(),
+        [&](std::string_view token, std::optional<Range> range) {
+            if (range) {
+                const size_t separator = token.find('!');
+                if (separator != std::string_view::npos)
+                    shape->expression_parts.back().append(
+                        token.substr(0, separator + 1)
+                    );
+                shape->expression_references.push_back({
+                    Translate(*range, origin),
+                    token.find(':') != std::string_view::npos
+                });
+                shape->expression_parts.emplace_back();
+            } else {
+                shape->expression_parts.back().append(token);
+            }
+        }
+    );
+
+    return shape;
+}
+}  // namespace
+
+std::unique_ptr<FormulaInterface> FormulaTable::Parse(std::string expression,
+                                                      Position anchor) {
+    // Key is the tokens of the expression separated by spaces with the cells
+    // and the ranges written relative to anchor, so that the lexing is the
+    // only work done for the known shapes
+    std::string key;
+    key.reserve(expression.size() + 16u);
+    const auto& append_offset = [&key, anchor](Position pos) {
+        key += std::to_string(pos.row - anchor.row);
+        key += ',';
+        key += std::to_string(pos.col - anchor.col);
+    };
+    TokenizeFormula(
+        expression,
+        [&](std::string_view token, std::optional<Range> range) {
+            if (range) {
+                const size_t separator = token.find('!');
+                if (separator != std::string_view::npos)
+                    key.append(token.substr(0, separator + 1));
+                key += '[';
+                append_offset(range->first);
+                if (token.find(':') != std::string_view::npos) {
+                    key += ':';
+                    append_offset(range->last);
+                }
+                key += ']';
+            } else {
+                key.append(token);
+            }
+            key += ' ';
+        }
+    );
+
+    {
+        std::lock_guard guard(mutex_);
+        const auto it = shapes_.find(key);
+        if (it != shapes_.end())
+            if (auto shape = it->second.lock())
+                return std::make_unique<SharedFormula>(std::move(shape), anchor);
+    }
+
+    // Parsed out of the lock, the shape parsed first by another thread wins
+    std::shared_ptr<const FormulaShape> shape = MakeFormulaShape(
+        expression, anchor
+    );
+
+    std::lock_guard guard(mutex_);
+    std::weak_ptr<const FormulaShape>& entry = shapes_[std::move(key)];
+    if (auto existing_shape = entry.lock())
+        shape = std::move(existing_shape);
+    else
+        entry = shape;
+
+    // Shapes released by all the formulas are erased in amortized constant
+    // time as the table grows
+    if (shapes_.size() >= cleanup_size_) {
+        for (auto it = shapes_.begin(); it != shapes_.end();) {
+            if (it->second.expired())
+                it = shapes_.erase(it);
+            else
+                ++it;
+        }
+        cleanup_size_ = std::max(cleanup_size_, 2u*shapes_.size());
+    }
+
+    return std::make_unique<SharedFormula>(std::move(shape), anchor);
+}
+
+size_t FormulaTable::GetShapesCount() const {
+    std::lock_guard guard(mutex_);
+    return std::count_if(shapes_.begin(), shapes_.end(), [](const auto& item) {
+        return !item.second.expired();
+    });
+}
+
+FormulaInterface::Value ParseNumber(std::string_view text) {
+    const auto& is_space = [](char c) {
+        return std::isspace(static_cast<unsigned char>(c)) != 0;
+    };
+    while (!text.empty() && is_space(text.front()))
+        text.remove_prefix(1u);
+    while (!text.empty() && is_space(text.back()))
+        text.remove_suffix(1u);
+    // from_chars() takes no plus sign, strtod() takes one before the digits
+    if (text.size() > 1u && text[0] == '+' && text[1] != '+' && text[1] != '-')
+        text.remove_prefix(1u);
+
+    double value = {};
+    const char* end = text.data() + text.size();
+    const auto [ptr, error_code] = std::from_chars(text.data(), end, value);
+    return error_code == std::errc() && ptr == end
+           ? FormulaInterface::Value(value)
+           : FormulaInterface::Value(FormulaError(FormulaError::Category::Value));
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> RestoreFormula(
+    std::string expression,
+    std::vector<FormulaAST::Instruction> program,
+    std::vector<std::string> sheets
+) {
+    return std::make_unique<Formula>(
+        std::move(expression),
+        FormulaAST(std::move(program), std::move(sheets))
+    );
 }
\ No newline at end of file
@@ -5,11 +5,18 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <variant>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // - Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// - Ссылки на ячейки и диапазоны: A1+B2, SUM(A1:B3)
+// - Функции SUM, AVERAGE, MIN, MAX и COUNT от чисел, ячеек и диапазонов
+// - Ссылки на ячейки и диапазоны других листов книги: Sheet2!A1,
+//   SUM(Sheet2!A1:B3)
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -22,6 +29,12 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Вычисляет формулу, получая значения ячеек через get_value, а числа
+    // диапазонов через get_range. Ссылки на другие листы вычисляются так же,
+    // с номером листа. Без книги (первый вариант) они дают ошибку #REF!.
+    virtual Value Evaluate(const FormulaAST::ValueGetter& get_value,
+                           const FormulaAST::RangeGetter& get_range) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
@@ -30,8 +43,68 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список диапазонов, которые задействованы в вычислении формулы,
+    // без повторений. Ячейки диапазонов не входят в GetReferencedCells().
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Возвращает имена других листов, на которые ссылается формула. Номер
+    // листа i > 0 в программе формулы соответствует имени с индексом i - 1.
+    virtual const std::vector<std::string>& GetReferencedSheets() const = 0;
+
+    // Возвращает ссылки на ячейки и диапазоны других листов без повторений,
+    // ячейка представлена диапазоном из одной ячейки. Ссылки на лист формулы
+    // сюда не входят.
+    virtual std::vector<FormulaAST::SheetRange> GetSheetRanges() const = 0;
+
+    // Возвращает скомпилированную программу формулы.
+    virtual std::vector<FormulaAST::Instruction> GetProgram() const = 0;
+
+    // Переносит формулу вместе со всеми ссылками на offset, как при переносе
+    // её ячейки вместе с ячейками, на которые она ссылается. Возвращает false
+    // и оставляет формулу как есть, если её ссылки хранятся не относительно
+    // ячейки или она ссылается на другие листы.
+    virtual bool Move(Position offset) = 0;
 };
 
+// Трактует текст ячейки как число так же, как strtod(): допускаются пробелы
+// вокруг числа и знак + перед ним, но текст должен быть числом целиком.
+// Иной текст, в том числе пустой, приводит к ошибке
+// FormulaError::Category::Value. Нулю равны только ячейки без содержимого.
+FormulaInterface::Value ParseNumber(std::string_view text);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Восстанавливает формулу по её выражению, скомпилированной программе и
+// именам листов, на которые она ссылается, без разбора выражения. Бросает
+// FormulaException, если программа некорректна.
+std::unique_ptr<FormulaInterface> RestoreFormula(
+    std::string expression,
+    std::vector<FormulaAST::Instruction> program,
+    std::vector<std::string> sheets = {}
+);
+
+struct FormulaShape;
+
+// Таблица форм формул листа. Формулы, которые отличаются только сдвигом ссылок
+// относительно своих ячеек (как в записи R1C1), разделяют одну
+// скомпилированную программу, а повторяющиеся формы не разбираются заново.
+// Методы можно вызывать из нескольких потоков.
+class FormulaTable {
+public:
+    // Разбирает выражение формулы ячейки anchor так же, как ParseFormula().
+    std::unique_ptr<FormulaInterface> Parse(std::string expression,
+                                            Position anchor);
+
+    // Возвращает число форм, используемых формулами.
+    size_t GetShapesCount() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const FormulaShape>> shapes_;
+
+    // Size of the table to erase the released shapes at
+    size_t cleanup_size_ = 64u;
+};
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "heap_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+// Blocks keep their size in front of them, so that operator delete knows
+// the bytes it releases
+const size_t BLOCK_HEADER = alignof(std::max_align_t);
+
+std::atomic<size_t> allocations_count = {0u};
+std::atomic<size_t> heap_bytes = {0u};
+}  // namespace
+
+size_t GetAllocationsCount() {
+    return allocations_count.load(std::memory_order_relaxed);
+}
+
+size_t GetHeapBytes() {
+    return heap_bytes.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    void* block = std::malloc(size + BLOCK_HEADER);
+    if (!block)
+        throw std::bad_alloc();
+
+    *static_cast<size_t*>(block) = size;
+    allocations_count.fetch_add(1u, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    return static_cast<char*>(block) + BLOCK_HEADER;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void* memory) noexcept {
+    if (!memory)
+        return;
+
+    void* block = static_cast<char*>(memory) - BLOCK_HEADER;
+    heap_bytes.fetch_sub(*static_cast<size_t*>(block),
+                         std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete[](void* memory) noexcept {
+    operator delete(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept {
+    operator delete(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
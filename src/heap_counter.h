@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+// The global operator new of the executable is replaced by a counting one,
+// so that the benchmarks see the allocations made and the heap in use
+
+// Number of the blocks allocated by operator new so far
+size_t GetAllocationsCount();
+
+// Bytes of the blocks allocated by operator new and not deleted yet
+size_t GetHeapBytes();
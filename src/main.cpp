@@ -1,5 +1,23 @@
 #include "common.h"
+#include "heap_counter.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <tuple>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << '(' << pos.row << ", " << pos.col << ')';
@@ -158,9 +176,2050 @@ void TestCircularDependencyException() {
     } catch (const CircularDependencyException&) {
     }
 }
+
+void TestFormulaCache() {
+    Sheet sheet;
+    const int chain_length = 1000;
+
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < chain_length; ++i)
+        sheet.SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "+1");
+
+    const Position last = {chain_length - 1, 0};
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), 1000);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 999u);
+
+    // Each formula reads the evaluated reference once
+    ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 999u);
+
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), 1000);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 999u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 1000u);
+
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), 1001);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 999u);
+}
+
+void TestFormulaCacheInvalidation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 0);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 2}));
+
+    sheet->SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 8);
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 0);
+
+    sheet->SetCell("C1"_pos, "=B1+1");
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 3);
+
+    sheet->ClearCell("C1"_pos);
+    sheet->ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+}
+
+void TestRecalculateDeepChain() {
+    Sheet sheet;
+    const int chain_length = 16000;
+
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < chain_length; ++i)
+        sheet.SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "*1");
+
+    const CellInterface* last = sheet.GetCell({chain_length - 1, 0});
+    ASSERT_EQUAL(std::get<double>(last->GetValue()), 1);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 2u*chain_length - 1u);
+
+    sheet.ResetCacheStatistics();
+    ASSERT_EQUAL(std::get<double>(last->GetValue()), 2);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+}
+
+void TestParallelRecalculate() {
+    const int rows_count = 4000;
+    const auto& fill_sheet = [rows_count](Sheet& sheet) {
+        for (int i = 0; i < rows_count; ++i) {
+            const std::string row = std::to_string(i + 1);
+            sheet.SetCell({i, 0}, std::to_string(i % 7));
+            sheet.SetCell({i, 1}, "=A" + row + "*2+1");
+            sheet.SetCell({i, 2}, "=B" + row + "/A" + row);
+            sheet.SetCell({i, 3}, "=C" + row + "-B" + row + "+A1");
+        }
+    };
+
+    Sheet serial_sheet;
+    fill_sheet(serial_sheet);
+    serial_sheet.Recalculate();
+
+    Sheet parallel_sheet;
+    parallel_sheet.SetWorkersCount(4);
+    fill_sheet(parallel_sheet);
+    parallel_sheet.Recalculate();
+    ASSERT_EQUAL(
+        parallel_sheet.GetCacheStatistics().misses,
+        serial_sheet.GetCacheStatistics().misses
+    );
+
+    std::ostringstream serial_values;
+    serial_sheet.PrintValues(serial_values);
+    std::ostringstream parallel_values;
+    parallel_sheet.PrintValues(parallel_values);
+    ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+
+    serial_sheet.SetCell("A1"_pos, "5");
+    serial_sheet.Recalculate();
+    parallel_sheet.SetCell("A1"_pos, "5");
+    parallel_sheet.Recalculate();
+
+    serial_values.str({});
+    serial_sheet.PrintValues(serial_values);
+    parallel_values.str({});
+    parallel_sheet.PrintValues(parallel_values);
+    ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+}
+
+void TestCircularDependencyDeepChain() {
+    auto sheet = CreateSheet();
+    const int chain_length = 10000;
+    for (int i = 1; i < chain_length; ++i)
+        sheet->SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "+1");
+
+    bool is_thrown = false;
+    try {
+        sheet->SetCell("A1"_pos, "=B1+A" + std::to_string(chain_length));
+    } catch (const CircularDependencyException&) {
+        is_thrown = true;
+    }
+    ASSERT(is_thrown);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "");
+
+    sheet->SetCell("A1"_pos, "=B1+1");
+    ASSERT_EQUAL(
+        std::get<double>(sheet->GetCell({chain_length - 1, 0})->GetValue()),
+        chain_length
+    );
+
+    is_thrown = false;
+    try {
+        sheet->SetCell("B1"_pos, "=A3");
+    } catch (const CircularDependencyException&) {
+        is_thrown = true;
+    }
+    ASSERT(is_thrown);
+}
+
+void TestFormulaProgram() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1");
+
+    const auto& evaluate = [&sheet](std::string expression) {
+        sheet->SetCell("C1"_pos, std::move(expression));
+        return sheet->GetCell("C1"_pos)->GetValue();
+    };
+
+    ASSERT_EQUAL(std::get<double>(evaluate("=1+2*3")), 7);
+    ASSERT_EQUAL(std::get<double>(evaluate("=(1+2)*3")), 9);
+    ASSERT_EQUAL(std::get<double>(evaluate("=-(A1+B1)*3/(4-5)")), 12);
+    ASSERT_EQUAL(std::get<double>(evaluate("=+A1--B1")), 4);
+    ASSERT_EQUAL(std::get<double>(evaluate("=10-4-3")), 3);
+    ASSERT_EQUAL(std::get<double>(evaluate("=12/A1/3")), 2);
+    ASSERT_EQUAL(
+        std::get<FormulaError>(evaluate("=1+A1/(B1-2)")),
+        FormulaError(FormulaError::Category::Div0)
+    );
+}
+
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "text");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=2*B1");
+    sheet->SetCell("A2"_pos, "=1/0");
+    sheet->SetCell("B2"_pos, "=1-A2");
+
+    const auto& get_error = [&sheet](Position pos) {
+        return std::get<FormulaError>(sheet->GetCell(pos)->GetValue());
+    };
+
+    ASSERT_EQUAL(get_error("B1"_pos).ToString(), "#VALUE!");
+    ASSERT_EQUAL(get_error("C1"_pos).ToString(), "#VALUE!");
+    ASSERT_EQUAL(get_error("A2"_pos).ToString(), "#DIV/0!");
+    ASSERT_EQUAL(get_error("B2"_pos).ToString(), "#DIV/0!");
+
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("A2"_pos, "=1/2");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 8);
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("B2"_pos)->GetValue()), 0.5);
+}
+
+void TestTextNumbers() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=A1*2");
+
+    const auto& evaluate = [&sheet](std::string text) {
+        sheet->SetCell("A1"_pos, std::move(text));
+        return sheet->GetCell("B1"_pos)->GetValue();
+    };
+
+    ASSERT_EQUAL(std::get<double>(evaluate("21")), 42);
+    ASSERT_EQUAL(std::get<double>(evaluate("-1.5e2")), -300);
+    ASSERT_EQUAL(std::get<double>(evaluate("'4")), 8);
+    ASSERT_EQUAL(std::get<double>(evaluate("")), 0);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("12abc")).ToString(), "#VALUE!");
+
+    // Spaces around a number and a plus sign before it are allowed, but the
+    // whole text has to be the number
+    ASSERT_EQUAL(std::get<double>(evaluate(" 12")), 24);
+    ASSERT_EQUAL(std::get<double>(evaluate("+5\t")), 10);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("+-5")).ToString(), "#VALUE!");
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("1 2")).ToString(), "#VALUE!");
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate(" ")).ToString(), "#VALUE!");
+
+    // Escaped empty text is text, not an empty cell
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("'")).ToString(), "#VALUE!");
+    ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("A1")->Evaluate(*sheet)).ToString(),
+                 "#VALUE!");
+    sheet->SetCell("C1"_pos, "=COUNT(A1:A2)+SUM(A1:A2)");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.));
+}
+
+void TestSparseStorage() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("Z16000"_pos, "far");
+    sheet->SetCell("B2"_pos, "=Z16000");
+    sheet->SetCell("BM65"_pos, "block");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{16000, 65}));
+    ASSERT(sheet->GetCell("Y16000"_pos) == nullptr);
+    ASSERT(sheet->GetCell("BL65"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("BM65"_pos)->GetText(), "block");
+
+    sheet->ClearCell("Z16000"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{65, 65}));
+    ASSERT(sheet->GetCell("Z16000"_pos) != nullptr);
+
+    sheet->SetCell("B2"_pos, "=C5");
+    ASSERT(sheet->GetCell("Z16000"_pos) == nullptr);
+    ASSERT(sheet->GetCell("C5"_pos) != nullptr);
+
+    sheet->ClearCell("B2"_pos);
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+
+    sheet->SetCell("C5"_pos, "reused");
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str().size(), 65u*65u + 5u + 6u);
+}
+
+void TestPrintableSizeTracking() {
+    auto sheet = CreateSheet();
+    const int rows_count = 10000;
+    for (int i = 0; i < rows_count; ++i)
+        sheet->SetCell({i, i % 3}, "x");
+    sheet->SetCell("E5"_pos, "=A1");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{rows_count, 5}));
+
+    sheet->SetCell("E5"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{rows_count, 3}));
+
+    for (int i = rows_count - 1; i >= 10; --i)
+        sheet->ClearCell({i, i % 3});
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{10, 3}));
+
+    sheet->ClearCell("C9"_pos);
+    sheet->ClearCell("C6"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{10, 3}));
+    sheet->ClearCell("C3"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{10, 2}));
+
+    for (int i = 0; i < 10; ++i)
+        sheet->ClearCell({i, i % 3});
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestPrintNumbers() {
+    const std::vector<std::string> formulas = {
+        "=1/3", "=0.1+0.2", "=1e20*3", "=-0", "=123456789", "=1e-7/3",
+        "=100000", "=1000000", "=2.5e-5", "=-7/9", "=1e300*1e10/1e300",
+    };
+
+    auto sheet = CreateSheet();
+    for (size_t i = 0; i < formulas.size(); ++i)
+        sheet->SetCell({0, static_cast<int>(i)}, formulas[i]);
+    sheet->SetCell("A2"_pos, "'=text");
+
+    // Formula texts print numbers in the shortest form parsed back to the
+    // same value. Shifts rewrite the formulas crossing the shifted area
+    // through these texts.
+    const std::vector<std::string> texts = {
+        "=1/3", "=0.1+0.2", "=1e+20*3", "=-0", "=123456789", "=1e-07/3",
+        "=1e+05", "=1e+06", "=2.5e-05", "=-7/9", "=1e+300*1e+10/1e+300",
+    };
+    for (size_t i = 0; i < texts.size(); ++i)
+        ASSERT_EQUAL(sheet->GetCell({0, static_cast<int>(i)})->GetText(), texts[i]);
+    sheet->SetCell("L1"_pos, "=0.123456789*3.14159265358979");
+    ASSERT_EQUAL(sheet->GetCell("L1"_pos)->GetText(), "=0.123456789*3.14159265358979");
+    sheet->ClearCell("L1"_pos);
+
+    const auto& print_expected = [&](std::ostream& output) {
+        for (size_t i = 0; i < formulas.size(); ++i) {
+            if (i > 0)
+                output << '\t';
+            output << sheet->GetCell({0, static_cast<int>(i)})->GetValue();
+        }
+        output << "\n=text" << std::string(formulas.size() - 1, '\t') << '\n';
+    };
+
+    std::ostringstream expected;
+    print_expected(expected);
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected.str());
+
+    std::ostringstream precise_expected;
+    precise_expected.precision(12);
+    print_expected(precise_expected);
+    std::ostringstream precise_values;
+    precise_values.precision(12);
+    sheet->PrintValues(precise_values);
+    ASSERT_EQUAL(precise_values.str(), precise_expected.str());
+
+    std::ostringstream errors;
+    errors << FormulaError(FormulaError::Category::Ref)
+           << FormulaError(FormulaError::Category::Value)
+           << FormulaError(FormulaError::Category::Div0);
+    ASSERT_EQUAL(errors.str(), "#REF!#VALUE!#DIV/0!");
+}
+
+void TestLoadTexts() {
+    Sheet sheet;
+    for (int i = 0; i < 3000; ++i) {
+        const std::string row = std::to_string(i + 1);
+        sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({i, 2}, "=A" + row + "*(B" + row + "+1)");
+        sheet.SetCell({i, 3}, i % 2 ? "'=text" : "=C" + row + "/A1");
+    }
+    sheet.SetCell("F1"_pos, "=G5");
+    sheet.SetCell("A3001"_pos, "=C3000+D2");
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+
+    Sheet loaded_sheet;
+    loaded_sheet.SetWorkersCount(4);
+    loaded_sheet.SetCell("Z1"_pos, "dropped");
+
+    std::istringstream input(texts.str());
+    loaded_sheet.LoadTexts(input);
+    ASSERT_EQUAL(loaded_sheet.GetPrintableSize(), sheet.GetPrintableSize());
+
+    std::ostringstream loaded_texts;
+    loaded_sheet.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+
+    std::ostringstream loaded_values;
+    loaded_sheet.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+
+    loaded_sheet.SetCell("G5"_pos, "7");
+    ASSERT_EQUAL(std::get<double>(loaded_sheet.GetCell("F1"_pos)->GetValue()), 7);
+}
+
+void TestLoadTextsErrors() {
+    Sheet sheet;
+    std::istringstream cycle("=B1\t=C2\n\t\t=A1\n");
+    try {
+        sheet.LoadTexts(cycle);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+
+    std::istringstream syntax_error("1\t=1+\n");
+    try {
+        sheet.LoadTexts(syntax_error);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestSetCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.));
+
+    sheet.SetCells({
+        {"A1"_pos, "5"},
+        {"C1"_pos, "=B1*2"},
+        {"A1"_pos, "2"},
+        {"D2"_pos, "text"},
+    });
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 4}));
+
+    // Cells referring to each other within one batch
+    sheet.SetCells({{"E1"_pos, "=F1+1"}, {"F1"_pos, "=C1"}});
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(7.));
+
+    sheet.SetCells({{"D2"_pos, ""}, {"F1"_pos, "=G1"}});
+    ASSERT(sheet.GetCell("G1"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 6}));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.));
+}
+
+void TestSetCellsRollback() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.));
+
+    try {
+        sheet.SetCells({
+            {"A1"_pos, "=C1"},
+            {"C1"_pos, "=D1"},
+            {"D1"_pos, "=B1"},
+        });
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+
+    sheet.ResetCacheStatistics();
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().hits, 1u);
+
+    try {
+        sheet.SetCells({{"A1"_pos, "3"}, {"E5"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+
+    try {
+        sheet.SetCells({{"A1"_pos, "3"}, {Position{-1, 0}, "1"}});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "'=text");
+    sheet.SetCell("C1"_pos, "=+A1*(A2+3)");
+    sheet.SetCell("A3"_pos, "=C1/A2");
+    sheet.SetCell("B3"_pos, "=-B1");
+    sheet.SetCell("C3"_pos, "=C1-(A1-1)");
+    sheet.SetCell("D3"_pos, "=COUNT(A1,A2)");
+
+    std::ostringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+
+    Sheet loaded;
+    loaded.SetCell("E5"_pos, "replaced");
+    loaded.LoadSnapshot(snapshot.str());
+    ASSERT_EQUAL(loaded.GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT(loaded.GetCell("A2"_pos) != nullptr);
+    ASSERT(loaded.GetCell("E5"_pos) == nullptr);
+
+    std::ostringstream texts, loaded_texts;
+    sheet.PrintTexts(texts);
+    loaded.PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+
+    // Values are restored with the formulas, nothing is evaluated
+    std::ostringstream values, loaded_values;
+    sheet.PrintValues(values);
+    loaded.ResetCacheStatistics();
+    loaded.PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+    ASSERT_EQUAL(loaded.GetCacheStatistics().misses, 0u);
+
+    // Dependencies are restored as well
+    loaded.SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(loaded.GetCell("A3"_pos)->GetValue(), CellInterface::Value(8.));
+    ASSERT_EQUAL(loaded.GetCell("C3"_pos)->GetValue(), CellInterface::Value(7.));
+    ASSERT_EQUAL(loaded.GetCell("D3"_pos)->GetValue(), CellInterface::Value(2.));
+    try {
+        loaded.SetCell("A2"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestSnapshotFile() {
+    Sheet sheet;
+    for (int i = 0; i < 100; ++i) {
+        sheet.SetCell({i, 0}, std::to_string(i));
+        sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+
+    const std::string path = "spreadsheet_snapshot_test.bin";
+    {
+        std::ofstream output(path, std::ios::binary);
+        sheet.SaveSnapshot(output);
+    }
+
+    Sheet loaded;
+    loaded.LoadSnapshotFile(path);
+    std::remove(path.c_str());
+
+    ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{100, 2}));
+    ASSERT_EQUAL(loaded.GetCell("B100"_pos)->GetValue(), CellInterface::Value(198.));
+}
+
+void TestSnapshotErrors() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1");
+    std::ostringstream output;
+    sheet.SaveSnapshot(output);
+    const std::string snapshot = output.str();
+
+    Sheet loaded;
+    for (size_t size : {size_t{0}, size_t{6}, snapshot.size() - 1}) {
+        loaded.SetCell("A1"_pos, "1");
+        try {
+            loaded.LoadSnapshot(std::string_view(snapshot).substr(0, size));
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+        ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{0, 0}));
+    }
+
+    try {
+        loaded.LoadSnapshot(snapshot + '\0');
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+
+    try {
+        loaded.LoadSnapshotFile("missing_snapshot.bin");
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+}
+
+// Returns printed tree and cells of the parsed formula or nothing on error
+template <typename Parse>
+std::optional<std::string> DescribeFormulaAST(Parse parse) {
+    try {
+        const FormulaAST ast = parse();
+        std::ostringstream output;
+        ast.Print(output);
+        output << " -> ";
+        ast.PrintFormula(output);
+        for (const Position& pos : ast.GetCells())
+            output << ' ' << pos.ToString();
+        return output.str();
+    } catch (...) {
+        return std::nullopt;
+    }
+}
+
+void TestFormulaParsers() {
+    const std::vector<std::string> pieces = {
+        "A1", "B2", "ZZ99", "A0", "XFD16384", "XFE1", "A", "a1", "1", "42",
+        ".5", "1.25", "1.", "2e3", "2E-3", "1e", "1e999", "1e-999", "+", "-",
+        "*", "/", "(", ")", " ", "\t", ".", "e", "#", "SUM", "MAX", "Sum",
+        ",", ":", "A1:B2", "B2:A1", "A1:", "XFD1:A16384", "!", "Data!", "a1!",
+        "Data!A1", "_s2!B2:C3", "SUM!A1", "A1!B2", "Data!A1:Data!B2",
+    };
+    const std::vector<std::string> operands = {
+        "A1", "C3", "7", ".5", "1e2", "Data!B2",
+    };
+    const std::vector<std::string> operators = {"+", "-", "*", "/"};
+    const std::vector<std::string> functions = {
+        "SUM", "AVERAGE", "MIN", "MAX", "COUNT",
+    };
+    const std::vector<std::string> ranges = {
+        "A1:B2", "C3:A1", "B2:B2", "Data!A1:B2",
+    };
+
+    std::mt19937 generator(42);
+    const auto& pick = [&generator](const std::vector<std::string>& items) {
+        return items[generator() % items.size()];
+    };
+
+    // Valid expressions of random shape
+    std::function<std::string(int)> make_expression = [&](int depth) {
+        switch (depth > 0 ? generator() % 5 : 0) {
+            case 0:
+                return pick(operands);
+            case 1:
+                return pick({"+", "-"}) + make_expression(depth - 1);
+            case 2:
+                return '(' + make_expression(depth - 1) + ')';
+            case 3: {
+                std::string call = pick(functions) + '(';
+                for (size_t j = generator() % 3 + 1; j > 0; --j)
+                    call += (generator() % 2 ? pick(ranges) : make_expression(depth - 1))
+                        + (j > 1 ? "," : "");
+                return call + ')';
+            } default:
+                return make_expression(depth - 1) + pick(operators)
+                    + make_expression(depth - 1);
+        }
+    };
+
+    for (int i = 0; i < 20000; ++i) {
+        std::string text;
+        if (i % 2 == 0) {
+            text = make_expression(5);
+        } else {
+            for (size_t j = generator() % 8; j > 0; --j)
+                text += pick(pieces);
+        }
+
+        std::istringstream input(text);
+        const auto expected = DescribeFormulaAST([&input]() {
+            return ParseFormulaAST(input);
+        });
+        const auto actual = DescribeFormulaAST([&text]() {
+            return ParseFormulaAST(text);
+        });
+        ASSERT_EQUAL(actual.value_or("error"), expected.value_or("error"));
+        if (i % 2 == 0)
+            ASSERT(actual.has_value());
+    }
+}
+
+void TestFormulaSharing() {
+    Sheet sheet;
+    for (int i = 1; i <= 1000; ++i) {
+        const std::string row = std::to_string(i);
+        sheet.SetCell(Position::FromString("A" + row), row);
+        sheet.SetCell(Position::FromString("B" + row), "2");
+        sheet.SetCell(Position::FromString("C" + row), "=(A" + row + " + B" + row + ")*2");
+    }
+    ASSERT_EQUAL(sheet.GetFormulaShapesCount(), 1u);
+
+    const CellInterface* cell = sheet.GetCell("C500"_pos);
+    ASSERT_EQUAL(cell->GetText(), "=(A500+B500)*2");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(1004.));
+    const std::vector<Position> referenced_cells = cell->GetReferencedCells();
+    ASSERT_EQUAL(referenced_cells.size(), 2u);
+    ASSERT(std::count(referenced_cells.begin(), referenced_cells.end(), "A500"_pos));
+    ASSERT(std::count(referenced_cells.begin(), referenced_cells.end(), "B500"_pos));
+
+    sheet.SetCell("B500"_pos, "3");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(1006.));
+
+    // Same cells with other offsets are another shape
+    sheet.SetCell("D1"_pos, "=(A1+B1)*2");
+    ASSERT_EQUAL(sheet.GetFormulaShapesCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(6.));
+
+    sheet.SetCell("C1"_pos, "=A1");
+    sheet.SetCell("D2"_pos, "=B2");
+    ASSERT_EQUAL(sheet.GetFormulaShapesCount(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(2.));
+
+    for (int i = 1; i <= 1000; ++i)
+        sheet.ClearCell({i - 1, 2});
+    sheet.ClearCell("D1"_pos);
+    sheet.ClearCell("D2"_pos);
+    ASSERT_EQUAL(sheet.GetFormulaShapesCount(), 0u);
+
+    try {
+        sheet.SetCell("E5"_pos, "=A1+ZZZZ1");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRangeFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1*3");
+    sheet.SetCell("C1"_pos, "=SUM(A1:B3)");
+    sheet.SetCell("C2"_pos, "=AVERAGE(B3:A1)");
+    sheet.SetCell("C3"_pos, "=MIN(A1:B3, -1)");
+    sheet.SetCell("C4"_pos, "=MAX(A1:B3)+1");
+    sheet.SetCell("C5"_pos, "=COUNT(A1:B3)");
+    sheet.SetCell("C6"_pos, "=AVERAGE(D1:D9)");
+    sheet.SetCell("C7"_pos, "=SUM(1, 2, A1:A2)*2");
+    sheet.SetCell("C8"_pos, "=MAX(D1:D9)+COUNT(D1)");
+
+    // Cell arguments are read as ranges of one cell
+    sheet.SetCell("C9"_pos, "=COUNT(D1,D1:D1,A3,A1)");
+    sheet.SetCell("C10"_pos, "=SUM(A3)+AVERAGE(A1,A3)");
+    sheet.SetCell("C11"_pos, "=AVERAGE(D1)");
+    sheet.SetCell("C12"_pos, "=SUM(C6)");
+
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(-1.));
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(4.));
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(3.));
+    ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(12.));
+    ASSERT_EQUAL(sheet.GetCell("C8"_pos)->GetValue(), CellInterface::Value(0.));
+    ASSERT_EQUAL(sheet.GetCell("C9"_pos)->GetValue(), CellInterface::Value(1.));
+    ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetValue(), CellInterface::Value(1.));
+    ASSERT_EQUAL(sheet.GetCell("C11"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C12"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=AVERAGE(A1:B3)");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=MIN(A1:B3,-1)");
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), "=SUM(1,2,A1:A2)*2");
+    ASSERT(sheet.GetCell("C1"_pos)->GetReferencedCells().empty());
+
+    // Range cells are not created for the formulas
+    ASSERT(sheet.GetCell("D5"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{12, 3}));
+
+    // Long ranges go through the whole unrolled loops and their tails
+    for (int i = 1; i <= 1001; ++i)
+        sheet.SetCell({i - 1, 4}, std::to_string(i % 2 ? i : -i));
+    sheet.SetCell("F1"_pos, "=SUM(E1:E1001)");
+    sheet.SetCell("F2"_pos, "=MIN(E1:E1001)");
+    sheet.SetCell("F3"_pos, "=MAX(E2:E1001)");
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(501.));
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(-1000.));
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(1001.));
+
+    try {
+        sheet.SetCell("G1"_pos, "=SUM(A1:B2");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    try {
+        sheet.SetCell("G1"_pos, "=A1:B2");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRangeDependencies() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*3");
+    sheet.SetCell("C1"_pos, "=SUM(A1:B3)");
+    sheet.SetCell("D1"_pos, "=C1+1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(7.));
+
+    // Changed, created and cleared range cells drop the cache
+    sheet.SetCell("A2"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(15.));
+    sheet.SetCell("B3"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(20.));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.));
+    sheet.SetCell("B2"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet.SetCell("B2"_pos, "=A2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(26.));
+
+    // Cycles through the ranges are found for the missing cells as well
+    const auto& expect_cycle = [&sheet](Position pos, std::string text) {
+        try {
+            sheet.SetCell(pos, std::move(text));
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    };
+    expect_cycle("A3"_pos, "=D1");
+    expect_cycle("C1"_pos, "=SUM(A1:C1)");
+    expect_cycle("A1"_pos, "=MAX(C1:D1)");
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    try {
+        sheet.SetCells({{"E1"_pos, "=SUM(F1:F2)"}, {"F2"_pos, "=E1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+
+    // Replaced range is not a dependency anymore
+    sheet.SetCell("C1"_pos, "=SUM(E1:E2)");
+    sheet.SetCell("A1"_pos, "=D1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.));
+
+    // Formulas of the same relative ranges share a shape
+    Sheet shared;
+    for (int i = 1; i <= 100; ++i) {
+        const std::string row = std::to_string(i);
+        shared.SetCell({i - 1, 0}, row);
+        const std::string next_row = std::to_string(i + 2);
+        shared.SetCell(
+            {i - 1, 1},
+            "=SUM(A" + row + ":A" + next_row + ")-COUNT(A" + row + ")"
+        );
+    }
+    ASSERT_EQUAL(shared.GetFormulaShapesCount(), 1u);
+    ASSERT_EQUAL(shared.GetCell("B10"_pos)->GetText(), "=SUM(A10:A12)-COUNT(A10)");
+    ASSERT_EQUAL(shared.GetCell("B10"_pos)->GetValue(), CellInterface::Value(32.));
+
+    // Ranges are restored from the snapshot with their dependencies
+    std::ostringstream snapshot;
+    shared.SaveSnapshot(snapshot);
+    Sheet loaded;
+    loaded.LoadSnapshot(snapshot.str());
+    ASSERT_EQUAL(loaded.GetCell("B10"_pos)->GetText(), "=SUM(A10:A12)-COUNT(A10)");
+    loaded.SetCell("A11"_pos, "0");
+    ASSERT_EQUAL(loaded.GetCell("B10"_pos)->GetValue(), CellInterface::Value(21.));
+    ASSERT_EQUAL(loaded.GetCell("B9"_pos)->GetValue(), CellInterface::Value(18.));
+    try {
+        loaded.SetCell("A3"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestOverlappingRanges() {
+    const int rows_count = 200;
+    const int formulas_count = 300;
+    std::mt19937 generator(17);
+
+    Sheet sheet;
+    std::vector<std::vector<double>> values(rows_count, {0., 0., 0.});
+    for (int i = 0; i < rows_count; ++i)
+        for (int j = 0; j < 3; j += 2) {
+            values[i][j] = static_cast<double>(generator() % 100);
+            sheet.SetCell({i, j}, std::to_string(values[i][j]));
+        }
+
+    std::vector<Range> ranges(formulas_count);
+    const auto& set_formula = [&](int i) {
+        const int first_row = static_cast<int>(generator() % rows_count);
+        const int last_row = first_row + static_cast<int>(
+            generator() % (rows_count - first_row)
+        );
+        const int first_col = static_cast<int>(generator() % 3);
+        ranges[i] = {{first_row, first_col}, {last_row, 2}};
+        sheet.SetCell({i, 4}, "=SUM(" + ranges[i].ToString() + ")");
+    };
+    const auto& expected_sum = [&](int i) {
+        double sum = 0.;
+        for (int row = ranges[i].first.row; row <= ranges[i].last.row; ++row)
+            for (int col = ranges[i].first.col; col <= 2; ++col)
+                sum += values[row][col];
+        return sum;
+    };
+
+    for (int i = 0; i < formulas_count; ++i)
+        set_formula(i);
+    sheet.Recalculate();
+
+    for (int edit = 0; edit < 200; ++edit) {
+        // Some formulas are moved to other ranges on the way
+        if (edit % 10 == 0)
+            set_formula(static_cast<int>(generator() % formulas_count));
+        sheet.Recalculate();
+
+        const Position pos = {
+            static_cast<int>(generator() % rows_count),
+            static_cast<int>(generator() % 2)*2
+        };
+        values[pos.row][pos.col] = static_cast<double>(generator() % 100);
+        sheet.SetCell(pos, std::to_string(values[pos.row][pos.col]));
+
+        // Only the formulas of the ranges containing the cell are dropped
+        sheet.ResetCacheStatistics();
+        sheet.Recalculate();
+        const size_t dependents_count = std::count_if(
+            ranges.begin(), ranges.end(), [pos](Range range) {
+                return range.Contains(pos);
+            }
+        );
+        ASSERT_EQUAL(sheet.GetCacheStatistics().misses, dependents_count);
+    }
+
+    for (int i = 0; i < formulas_count; ++i)
+        ASSERT_EQUAL(
+            sheet.GetCell({i, 4})->GetValue(),
+            CellInterface::Value(expected_sum(i))
+        );
+
+    for (int i = 0; i < formulas_count; ++i)
+        sheet.ClearCell({i, 4});
+    sheet.SetCell("A1"_pos, "-1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{rows_count, 3}));
+}
+
+void TestColumnValues() {
+    Sheet sheet;
+    for (int i = 0; i < 1000; ++i)
+        sheet.SetCell({i, 0}, std::to_string(i + 1));
+    sheet.SetCell("A300"_pos, "text");
+    sheet.SetCell("A301"_pos, "'7");
+    sheet.SetCell("A302"_pos, "=A301*2");
+    sheet.ClearCell("A303"_pos);
+
+    sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("B2"_pos, "=COUNT(A1:A5000,C1:C5000)");
+    sheet.SetCell("B3"_pos, "=A300");
+    sheet.SetCell("B4"_pos, "=A303+A302+Z9999");
+    sheet.SetCell("B5"_pos, "=MAX(A990:A5000)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(499315.));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(998.));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(14.));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(1000.));
+
+    // Stored values follow the cell changes
+    sheet.SetCell("A300"_pos, "300");
+    sheet.SetCell("A302"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(300.));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet.SetCell("A302"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(499601.));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    // Formulas evaluated in parallel store their values concurrently
+    std::ostringstream texts;
+    for (int i = 1; i <= 3000; ++i)
+        texts << i << "\t=SUM(A1:A" << i << ")\t=B" << i << "-A" << i << '\n';
+    Sheet loaded;
+    loaded.SetWorkersCount(4);
+    std::istringstream input(texts.str());
+    loaded.LoadTexts(input);
+    loaded.Recalculate();
+    ASSERT_EQUAL(loaded.GetCell("B3000"_pos)->GetValue(), CellInterface::Value(4501500.));
+    ASSERT_EQUAL(loaded.GetCell("C3000"_pos)->GetValue(), CellInterface::Value(4498500.));
+}
+
+void TestCellReuse() {
+    Sheet sheet;
+
+    // Cells never move while the slabs of the storage grow
+    sheet.SetCell("A1"_pos, "0");
+    const CellInterface* first_cell = sheet.GetCell("A1"_pos);
+    for (int i = 1; i < 200; ++i)
+        sheet.SetCell({i % 64, i/64}, std::to_string(i));
+    ASSERT(sheet.GetCell("A1"_pos) == first_cell);
+
+    // Released cell is reused with its id by the next insertion and takes
+    // the new content
+    const auto* released = static_cast<const Cell*>(sheet.GetCell("B2"_pos));
+    const CellId released_id = released->GetId();
+    sheet.ClearCell("B2"_pos);
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+    sheet.SetCell("H60"_pos, "=A1+1");
+    const auto* reused = static_cast<const Cell*>(sheet.GetCell("H60"_pos));
+    ASSERT(reused == released);
+    ASSERT_EQUAL(reused->GetId(), released_id);
+    ASSERT_EQUAL(reused->GetPosition(), "H60"_pos);
+    ASSERT_EQUAL(reused->GetValue(), CellInterface::Value(1.));
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(reused->GetValue(), CellInterface::Value(6.));
+
+    // Ids of the released cells are given to the next created ones
+    sheet.SetCell("ZZ1000"_pos, "far");
+    const CellId far_id
+        = static_cast<const Cell*>(sheet.GetCell("ZZ1000"_pos))->GetId();
+    sheet.ClearCell("ZZ1000"_pos);
+    sheet.SetCell("ZZ2000"_pos, "farther");
+    ASSERT_EQUAL(
+        static_cast<const Cell*>(sheet.GetCell("ZZ2000"_pos))->GetId(),
+        far_id
+    );
+}
+
+void TestCellContent() {
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=SUM(A1:A2)+A1");
+    const Cell* cell = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    const std::string long_text(100, 'x');
+
+    // Content of the same cell goes through all the kinds
+    const std::vector<std::pair<std::string, double>> texts = {
+        {"'5", 10.}, {"=1+2", 6.}, {long_text, 0.}, {"7", 14.}, {"", 0.},
+        {"=A2", 0.}, {"text", 0.},
+    };
+    for (const auto& [text, expected] : texts) {
+        sheet.SetCell("A1"_pos, text);
+        ASSERT_EQUAL(cell->GetText(), text);
+        if (text == long_text || text == "text") {
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        } else {
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(expected));
+        }
+    }
+
+    // Texts of numbers are still texts for the value readers
+    sheet.SetCell("A1"_pos, "'5");
+    ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(std::string("5")));
+    ASSERT(cell->GetValueView() == Cell::ValueView(std::string_view("5")));
+    sheet.SetCell("A1"_pos, long_text);
+    ASSERT(cell->GetValueView() == Cell::ValueView(std::string_view(long_text)));
+
+    // Numbers are written as texts and parsed again when restored
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("A2"_pos, "'2");
+    std::ostringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet loaded;
+    loaded.LoadSnapshot(snapshot.str());
+    loaded.SetCell("A3"_pos, "=A1+A2");
+    ASSERT_EQUAL(loaded.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.5));
+    ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.));
+}
+
+void TestInvalidationCount() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 0; i < 1000; ++i)
+        sheet.SetCell({i, 1}, "=A1*" + std::to_string(i + 1));
+    sheet.SetCell("C1"_pos, "=SUM(B1:B1000)+B1+B2");
+    sheet.SetCell("C2"_pos, "=C1+A1");
+    sheet.Recalculate();
+
+    // Each dependent is dropped once, whatever number of paths leads to it
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 1002u);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(1001008.));
+
+    // Dirty cells stop the walk, their dependents are dirty already
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("B500"_pos, "=A1");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 2u);
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 2u + 999u);
+    sheet.SetCell("B2"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 2u + 999u);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(1500013.));
+
+    // Edits of a batch drop their shared dependents in one walk
+    sheet.ResetCacheStatistics();
+    std::vector<std::pair<Position, std::string>> edits;
+    for (int i = 0; i < 1000; ++i)
+        edits.emplace_back(Position{i, 1}, "=A1*" + std::to_string(i + 2));
+    sheet.SetCells(std::move(edits));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 2u);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(1504518.));
+}
+
+void TestDependencyGraph() {
+    Sheet sheet;
+
+    // Repeated references make a single edge
+    sheet.SetCell("B1"_pos, "=A1+A1*A1");
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.));
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+
+    // Ids of the released blocks go to the cells created later, the edges
+    // are merged into the rows many times on the way
+    for (int round = 0; round < 4; ++round) {
+        const int first_row = round % 2 ? 1000 : 0;
+        for (int i = 0; i < 300; ++i)
+            sheet.SetCell(
+                {first_row + i, 100},
+                "=" + Position{first_row + i, 101}.ToString()
+                + "+" + Position{first_row, 102}.ToString()
+            );
+        sheet.SetCell({first_row, 102}, std::to_string(round));
+        ASSERT_EQUAL(
+            sheet.GetCell({first_row + 299, 100})->GetValue(),
+            CellInterface::Value(static_cast<double>(round))
+        );
+
+        try {
+            sheet.SetCells({
+                {{first_row + 5, 101}, "1"},
+                {{first_row, 102}, "=" + Position{first_row + 7, 100}.ToString()},
+            });
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        sheet.SetCell({first_row + 7, 101}, "=" + Position{first_row, 102}.ToString());
+        ASSERT_EQUAL(
+            sheet.GetCell({first_row + 7, 100})->GetValue(),
+            CellInterface::Value(2.*round)
+        );
+
+        for (int i = 0; i < 300; ++i)
+            sheet.ClearCell({first_row + i, 100});
+        sheet.ClearCell({first_row + 7, 101});
+        sheet.ClearCell({first_row, 102});
+        ASSERT(sheet.GetCell({first_row, 102}) == nullptr);
+        ASSERT(sheet.GetCell({first_row + 299, 101}) == nullptr);
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    // Loading replaces the graph as well
+    sheet.SetCell("A1"_pos, "=B1");
+    std::istringstream input("=B1\t=C1\n");
+    sheet.LoadTexts(input);
+    sheet.SetCell("C1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.));
+}
+
+void TestGetValues() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < 2000; ++i)
+        for (int j = 0; j < 4; ++j)
+            sheet.SetCell({i, j}, "=" + Position{i - 1, j}.ToString() + "+1");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.Recalculate();
+
+    // Viewport evaluates its dirty cells and their precedents only
+    sheet.ResetCacheStatistics();
+    sheet.SetCell("A1"_pos, "10");
+    const auto values = sheet.GetValues(Range::FromString("A10:E11"));
+    ASSERT_EQUAL(values.size(), 10u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 10u);
+    ASSERT_EQUAL(values[0], CellInterface::Value(19.));
+    ASSERT(std::holds_alternative<FormulaError>(values[1]));
+    ASSERT(std::holds_alternative<FormulaError>(values[2]));
+    ASSERT_EQUAL(values[3], CellInterface::Value(9.));
+    ASSERT_EQUAL(values[4], CellInterface::Value(std::string()));
+    ASSERT_EQUAL(values[5], CellInterface::Value(20.));
+    ASSERT_EQUAL(values[8], CellInterface::Value(10.));
+
+    // The rest stays dirty until read
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("A12"_pos))->IsCached());
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("D2000"_pos))->IsCached());
+    ASSERT_EQUAL(sheet.GetCell("A2000"_pos)->GetValue(), CellInterface::Value(2009.));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 1999u);
+
+    try {
+        sheet.GetValues({"B2"_pos, "A1"_pos});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestInsertDeleteRows() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    sheet.SetCell("B4"_pos, "=SUM(A1:A3)");
+    sheet.SetCell("C1"_pos, "=A2+A3");
+    sheet.SetCell("C2"_pos, "=SUM(A5:A8)");
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 3}));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5*10");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=SUM(A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A4+A5");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=SUM(A7:A10)");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(6.));
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+
+    // Edits reach the formulas through the shifted references
+    sheet.SetCell("A5"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(40.));
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(7.));
+    sheet.SetCell("A2"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(17.));
+
+    // Deleted cells turn into #REF!, ranges shrink
+    sheet.DeleteRows(1, 4);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=SUM(A1:A1)");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.));
+    ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+
+    sheet.SetCell("C1"_pos, "=SUM(A2:A3)+A1");
+    sheet.DeleteRows(1, 3);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(#REF!)+A1");
+
+    // Formulas with #REF! are parsed and saved as any other
+    sheet.SetCell("D1"_pos, "=1+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    std::ostringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    Sheet restored;
+    restored.LoadSnapshot(snapshot.str());
+    ASSERT_EQUAL(restored.GetCell("D1"_pos)->GetText(), "=1+#REF!");
+    try {
+        sheet.SetCell("D2"_pos, "=#REF");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // Numbers of the rewritten formulas keep all their digits
+    Sheet precise;
+    precise.SetCell("A1"_pos, "2");
+    precise.SetCell("B2"_pos, "=A1*0.123456789");
+    precise.SetCell("B3"_pos, "=B2/3.14159265358979+1e20");
+    const CellInterface::Value value = precise.GetCell("B3"_pos)->GetValue();
+    precise.InsertRows(1);
+    ASSERT_EQUAL(precise.GetCell("B3"_pos)->GetText(), "=A1*0.123456789");
+    ASSERT_EQUAL(precise.GetCell("B4"_pos)->GetText(), "=B3/3.14159265358979+1e+20");
+    ASSERT_EQUAL(precise.GetCell("B4"_pos)->GetValue(), value);
+    precise.DeleteRows(1);
+    ASSERT_EQUAL(precise.GetCell("B2"_pos)->GetValue(), CellInterface::Value(2*0.123456789));
+}
+
+void TestInsertDeleteCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("C1"_pos, "=A1+B1");
+    sheet.SetCell("A2"_pos, "=SUM(A1:C1)");
+    sheet.SetCell("A3"_pos, "=C1");
+
+    sheet.InsertCols(1);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=A1+C1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=SUM(A1:D1)");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=D1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.));
+
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+B1");
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+
+    // Nothing changes if a cell is shifted out of the table
+    sheet.SetCell({0, Position::MAX_COLS - 1}, "=C1");
+    try {
+        sheet.InsertCols(0);
+        ASSERT(false);
+    } catch (const TableTooBigException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+B1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, Position::MAX_COLS}));
+
+    // Only the formulas referring across the shifted area are rewritten
+    Sheet large;
+    for (int i = 0; i < 1000; ++i)
+        large.SetCell({i, 0}, "=B" + std::to_string(i + 1) + "+1");
+    large.SetCell("C1"_pos, "=SUM(A1:A1000)");
+    large.Recalculate();
+    large.ResetCacheStatistics();
+    large.InsertRows(999);
+    ASSERT_EQUAL(large.GetCell("C1"_pos)->GetText(), "=SUM(A1:A1001)");
+    ASSERT_EQUAL(large.GetCell("A1001"_pos)->GetText(), "=B1001+1");
+    ASSERT_EQUAL(large.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1000.));
+    ASSERT_EQUAL(large.GetCacheStatistics().misses, 1u);
+}
+
+void TestShiftedCaches() {
+    Sheet sheet;
+    for (int i = 0; i < 1000; ++i) {
+        const std::string row = std::to_string(i + 1);
+        sheet.SetCell({i, 0}, row);
+        sheet.SetCell({i, 1}, i == 0 ? "=A1" : "=B" + std::to_string(i) + "+A" + row);
+    }
+    sheet.SetCell("C1"_pos, "=SUM(B1:B1000)");
+    sheet.Recalculate();
+    sheet.ResetCacheStatistics();
+    const CellId id
+        = static_cast<const Cell*>(sheet.GetCell("B1000"_pos))->GetId();
+
+    // Formulas moved with all their references keep their ids and caches
+    sheet.InsertRows(0);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(static_cast<const Cell*>(sheet.GetCell("B1001"_pos))->GetId(), id);
+    ASSERT_EQUAL(sheet.GetCell("B1001"_pos)->GetText(), "=B1000+A1001");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=SUM(B2:B1001)");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(167167000.));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 0u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 0u);
+
+    // Moved cells keep their dependents
+    sheet.SetCell("A2"_pos, "1001");
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 1001u);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(168167000.));
+
+    // Formula referring across the inserted row is set again with its
+    // dependents and the range crossing it
+    sheet.ResetCacheStatistics();
+    sheet.InsertRows(500);
+    ASSERT_EQUAL(sheet.GetCell("B502"_pos)->GetText(), "=B500+A502");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=SUM(B2:B1002)");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(168167000.));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 500u + 1u);
+    ASSERT_EQUAL(sheet.GetCacheStatistics().misses, 501u + 1u);
+
+    // Deleted cells drop the caches of their dependents, the moved cells
+    // referring to them are set again
+    sheet.ResetCacheStatistics();
+    sheet.DeleteRows(0, 2);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!+A1");
+    ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetText(), "=B999+A1000");
+    ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCacheStatistics().invalidations, 999u + 2u);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 2}));
+
+    // Restored formulas do not share shapes, the moved ones are set again
+    Sheet saved;
+    saved.SetCell("A1"_pos, "2");
+    saved.SetCell("A2"_pos, "=A1*3");
+    std::ostringstream snapshot;
+    saved.SaveSnapshot(snapshot);
+    Sheet restored;
+    restored.LoadSnapshot(snapshot.str());
+    restored.InsertRows(0, 2);
+    ASSERT_EQUAL(restored.GetCell("A4"_pos)->GetText(), "=A3*3");
+    ASSERT_EQUAL(restored.GetCell("A4"_pos)->GetValue(), CellInterface::Value(6.));
+    restored.SetCell("A3"_pos, "5");
+    ASSERT_EQUAL(restored.GetCell("A4"_pos)->GetValue(), CellInterface::Value(15.));
+}
+
+void TestWorkbook() {
+    Workbook book;
+    Sheet& main_sheet = book.AddSheet("Main");
+    Sheet& data = book.AddSheet("Data");
+    ASSERT_EQUAL(book.GetSheetsCount(), 2u);
+    ASSERT(book.GetSheet("Data") == &data);
+    ASSERT(book.GetSheet("Other") == nullptr);
+    for (const char* name : {"Data", "1st", "Other sheet", ""}) {
+        try {
+            book.AddSheet(name);
+            ASSERT(false);
+        } catch (const std::invalid_argument&) {
+        }
+    }
+
+    data.SetCell("A1"_pos, "2");
+    data.SetCell("A2"_pos, "3");
+    main_sheet.SetCell("A1"_pos, "=Data!A1*10");
+    main_sheet.SetCell("B1"_pos, "=SUM(Data!A1:A3)+A1");
+    ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetText(), "=Data!A1*10");
+    ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.));
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(25.));
+
+    // Edits of a sheet drop the caches of the formulas of the other sheets
+    data.SetCell("A1"_pos, "4");
+    data.SetCell("A3"_pos, "=Main!A1");
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(87.));
+
+    // Cycles across the sheets are rejected
+    try {
+        data.SetCell("A2"_pos, "=Main!B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(data.GetCell("A2"_pos)->GetText(), "3");
+
+    // Unknown sheets are formula errors, a standalone sheet knows none
+    for (const char* text : {"=Other!A1", "=data!A1", "=SUM(Other!A1:B2)"}) {
+        try {
+            main_sheet.SetCell("C1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+    ASSERT(main_sheet.GetCell("C1"_pos) == nullptr);
+    Sheet standalone;
+    try {
+        standalone.SetCell("A1"_pos, "=Data!A1");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // Dirty cells of all the sheets are evaluated at once
+    data.SetCell("A2"_pos, "5");
+    main_sheet.ResetCacheStatistics();
+    book.Recalculate();
+    ASSERT_EQUAL(main_sheet.GetCacheStatistics().misses, 1u);
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(89.));
+
+    // Replaced sheet drops the caches of the formulas referring to it
+    std::istringstream texts("7\n");
+    data.LoadTexts(texts);
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(77.));
+
+    // Snapshots refer to the other sheets by name
+    std::ostringstream snapshot;
+    main_sheet.SaveSnapshot(snapshot);
+    main_sheet.LoadSnapshot(snapshot.str());
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetText(), "=SUM(Data!A1:A3)+A1");
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(77.));
+    data.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.));
+
+    Workbook other_book;
+    try {
+        other_book.AddSheet("Main").LoadSnapshot(snapshot.str());
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+
+    // Formulas of one shape referring to another sheet are shared
+    const size_t shapes_count = main_sheet.GetFormulaShapesCount();
+    for (int i = 0; i < 100; ++i)
+        main_sheet.SetCell({i, 3}, "=Data!A" + std::to_string(i + 1) + "*2");
+    ASSERT_EQUAL(main_sheet.GetFormulaShapesCount(), shapes_count + 1u);
+    ASSERT_EQUAL(main_sheet.GetCell("D100"_pos)->GetText(), "=Data!A100*2");
+    ASSERT_EQUAL(main_sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.));
+    data.SetCell("A100"_pos, "3");
+    ASSERT_EQUAL(main_sheet.GetCell("D100"_pos)->GetValue(), CellInterface::Value(6.));
+}
+
+void TestWorkbookInsertDelete() {
+    Workbook book;
+    Sheet& main_sheet = book.AddSheet("Main");
+    Sheet& data = book.AddSheet("Data");
+    data.SetCell("A1"_pos, "1");
+    data.SetCell("A2"_pos, "2");
+    data.SetCell("B1"_pos, "=A2+Main!A1");
+    main_sheet.SetCell("A1"_pos, "=Data!A2*10");
+    main_sheet.SetCell("B1"_pos, "=SUM(Data!A1:A2)");
+    main_sheet.SetCell("C1"_pos, "=A1");
+
+    // References to the shifted sheet are rewritten on all the sheets
+    data.InsertRows(1);
+    ASSERT_EQUAL(data.GetCell("B1"_pos)->GetText(), "=A3+Main!A1");
+    ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetText(), "=Data!A3*10");
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetText(), "=SUM(Data!A1:A3)");
+    ASSERT_EQUAL(main_sheet.GetCell("C1"_pos)->GetText(), "=A1");
+    ASSERT_EQUAL(data.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.));
+
+    main_sheet.InsertCols(0);
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetText(), "=Data!A3*10");
+    ASSERT_EQUAL(main_sheet.GetCell("D1"_pos)->GetText(), "=B1");
+    ASSERT_EQUAL(data.GetCell("B1"_pos)->GetText(), "=A3+Main!B1");
+    ASSERT_EQUAL(data.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.));
+
+    data.DeleteRows(2);
+    ASSERT_EQUAL(main_sheet.GetCell("B1"_pos)->GetText(), "=#REF!*10");
+    ASSERT_EQUAL(main_sheet.GetCell("C1"_pos)->GetText(), "=SUM(Data!A1:A2)");
+    ASSERT_EQUAL(data.GetCell("B1"_pos)->GetText(), "=#REF!+Main!B1");
+    ASSERT_EQUAL(main_sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(main_sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.));
+
+    // All the sheets are rewritten as one edit, so that the moved cells
+    // never meet the old references of the other sheets
+    Workbook cyclic_book;
+    Sheet& first = cyclic_book.AddSheet("First");
+    Sheet& second = cyclic_book.AddSheet("Second");
+    first.SetCell("A1"_pos, "=Second!A1+1");
+    second.SetCell("A1"_pos, "=First!A2");
+    first.InsertRows(0);
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetText(), "=Second!A1+1");
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=First!A3");
+    ASSERT(first.GetCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(first.GetPrintableSize(), (Size{2, 1}));
+}
 }  // namespace
 
-int main() {
+namespace bench {
+// Timing scenarios run by `spreadsheet --bench [name...]`. A scenario builds
+// its sheet untimed and prints the best time of its measured part.
+const int REPEATS = 5;
+
+using Clock = std::chrono::steady_clock;
+
+// Runs prepare() untimed and measured() timed REPEATS times, returns the best
+// time in milliseconds
+template <typename Prepare, typename Measured>
+double Measure(Prepare prepare, Measured measured) {
+    double best = 0.;
+    for (int i = 0; i < REPEATS; ++i) {
+        prepare();
+        const Clock::time_point start = Clock::now();
+        measured();
+        const std::chrono::duration<double, std::milli> elapsed =
+            Clock::now() - start;
+        best = i == 0 ? elapsed.count() : std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+void Report(const std::string& name, double ms, const std::string& note = "") {
+    std::cout << name << '\t' << std::fixed << std::setprecision(1) << ms
+              << " ms";
+    if (!note.empty())
+        std::cout << '\t' << note;
+    std::cout << std::endl;
+}
+
+std::string CellName(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// Peak resident set size of the process in MiB, 0 where it is not known
+size_t GetPeakRssMiB() {
+#ifdef _WIN32
+    return 0u;
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss) >> 20;
+#else
+    return static_cast<size_t>(usage.ru_maxrss) >> 10;
+#endif
+#endif
+}
+
+// 16000 independent columns four levels deep: values in the first row and
+// formulas over the cells above them in the other rows
+void RecalculateWide() {
+    const int cols = 16000;
+    for (const size_t workers : {1u, 2u, 4u, 8u}) {
+        Sheet sheet;
+        sheet.SetWorkersCount(workers);
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell({1, col}, "=" + CellName(0, col) + "*2");
+            sheet.SetCell({2, col},
+                          "=" + CellName(0, col) + "+" + CellName(1, col));
+            sheet.SetCell({3, col}, "=" + CellName(2, col) + "/2+1");
+        }
+
+        int edit = 0;
+        const double ms = Measure([&sheet, &edit] {
+            ++edit;
+            for (int col = 0; col < cols; ++col)
+                sheet.SetCell({0, col}, std::to_string(col + edit));
+        }, [&sheet] {
+            sheet.Recalculate();
+        });
+        Report("recalculate-wide/" + std::to_string(workers), ms,
+               std::to_string(3*cols) + " formulas");
+    }
+}
+
+// SetCell of a formula over the head of a 10000-cell chain, its cycle check
+// walks the whole chain, and of the formula closing the chain into a cycle
+void CycleCheckChain() {
+    const int length = 10000;
+    Sheet sheet;
+    for (int row = 0; row < length; ++row)
+        sheet.SetCell({row, 1}, "=" + CellName(row + 1, 1) + "+1");
+
+    const int sets = 100;
+    const double set_ms = Measure([] {}, [&sheet] {
+        for (int i = 0; i < sets; ++i)
+            sheet.SetCell("A1"_pos, "=B1+" + std::to_string(i));
+    });
+    Report("cycle-check-chain/set", set_ms,
+           std::to_string(sets) + " cells set");
+
+    const double close_ms = Measure([] {}, [&sheet] {
+        try {
+            sheet.SetCell({length, 1}, "=A1");
+        } catch (const CircularDependencyException&) {
+            return;
+        }
+        throw std::logic_error("cycle is not detected");
+    });
+    Report("cycle-check-chain/close", close_ms, "1 cycle rejected");
+}
+
+// Recalculate() of 16000 rows of formulas =An+1 and =Bn*2 over the values
+// =n/0 evaluated to #DIV/0!, and over the values =n/3 for comparison
+void ErrorCells() {
+    const int rows = 16000;
+    for (const std::string divisor : {"0", "3"}) {
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 1}, "=" + CellName(row, 0) + "+1");
+            sheet.SetCell({row, 2}, "=" + CellName(row, 1) + "*2");
+        }
+
+        const double ms = Measure([&sheet, &divisor] {
+            for (int row = 0; row < rows; ++row)
+                sheet.SetCell({row, 0},
+                              "=" + std::to_string(row) + "/" + divisor);
+        }, [&sheet] {
+            sheet.Recalculate();
+        });
+        Report(divisor == "0" ? "error-cells/errors" : "error-cells/numbers",
+               ms, std::to_string(3*rows) + " formulas");
+    }
+}
+
+// SetCell and GetCell of the cells of a dense 1000x100 block, of 10000 cells
+// scattered over A1:FAN4096 and of the 4096 cells of its diagonal, and the
+// heap the sheet takes for them
+void Storage() {
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> coordinate(0, 4095);
+    std::vector<Position> dense, sparse, diagonal;
+    for (int row = 0; row < 1000; ++row)
+        for (int col = 0; col < 100; ++col)
+            dense.push_back({row, col});
+    for (int i = 0; i < 10000; ++i)
+        sparse.push_back({coordinate(generator), coordinate(generator)});
+    for (int i = 0; i < 4096; ++i)
+        diagonal.push_back({i, i});
+
+    for (const auto& [name, positions] : {std::pair{"dense", &dense},
+                                          std::pair{"sparse", &sparse},
+                                          std::pair{"diagonal", &diagonal}}) {
+        std::optional<Sheet> sheet;
+        const size_t heap = GetHeapBytes();
+        const double set_ms = Measure([&sheet] {
+            sheet.emplace();
+        }, [&sheet, positions = positions] {
+            for (const Position pos : *positions)
+                sheet->SetCell(pos, "1");
+        });
+        const size_t sheet_heap = GetHeapBytes() - heap;
+
+        const double get_ms = Measure([] {}, [&sheet, positions = positions] {
+            for (const Position pos : *positions)
+                if (sheet->GetCell(pos) == nullptr)
+                    throw std::logic_error("cell is lost");
+        });
+        const std::string cells = std::to_string(positions->size()) + " cells";
+        Report("storage/" + std::string(name) + "/set", set_ms,
+               cells + ", " + std::to_string(sheet_heap >> 10) + " KiB");
+        Report("storage/" + std::string(name) + "/get", get_ms, cells);
+    }
+}
+
+// PrintValues() and PrintTexts() of 1000x1000 cells, the numbers n/8 and
+// texts in turn, into a string stream
+void Print() {
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row)
+        for (int col = 0; col < 1000; ++col) {
+            std::ostringstream text;
+            if (col % 2 == 0)
+                text << (row*1000 + col) / 8.;
+            else
+                text << "text";
+            sheet.SetCell({row, col}, text.str());
+        }
+
+    for (const bool values : {true, false}) {
+        std::ostringstream output;
+        const double ms = Measure([&output] {
+            output.str({});
+        }, [&sheet, &output, values] {
+            if (values)
+                sheet.PrintValues(output);
+            else
+                sheet.PrintTexts(output);
+        });
+
+        const double mb = output.str().size() / 1e6;
+        std::ostringstream note;
+        note << std::fixed << std::setprecision(1) << mb << " MB, "
+             << mb / ms * 1e3 << " MB/s";
+        Report(values ? "print/values" : "print/texts", ms, note.str());
+    }
+}
+
+// Sets the cells of the tab separated texts one by one
+void ReplayTexts(Sheet& sheet, const std::string& texts) {
+    std::istringstream input(texts);
+    std::string line;
+    for (int row = 0; std::getline(input, line); ++row) {
+        std::istringstream fields(line);
+        std::string text;
+        for (int col = 0; std::getline(fields, text, '\t'); ++col)
+            if (!text.empty())
+                sheet.SetCell({row, col}, text);
+    }
+}
+
+// LoadTexts() of 10000x100 cells against replaying them through SetCell().
+// In the flat sheet the formulas =<left>+1 refer to the values on their left,
+// in the chained one every row is a chain of 99 such formulas.
+void LoadTexts() {
+    for (const bool chained : {false, true}) {
+        std::string texts;
+        for (int row = 0; row < 10000; ++row) {
+            for (int col = 0; col < 100; ++col) {
+                if (col > 0)
+                    texts += '\t';
+                if (col == 0 || (!chained && col % 2 == 0))
+                    texts += std::to_string(row + col);
+                else
+                    texts += "=" + CellName(row, col - 1) + "+1";
+            }
+            texts += '\n';
+        }
+
+        const std::string name = chained ? "load-texts/chained/"
+                                         : "load-texts/flat/";
+        std::optional<Sheet> sheet;
+        Report(name + "set-cell", Measure([&sheet] {
+            sheet.emplace();
+        }, [&sheet, &texts] {
+            ReplayTexts(*sheet, texts);
+        }), "1000000 cells");
+        Report(name + "load", Measure([&sheet] {
+            sheet.emplace();
+        }, [&sheet, &texts] {
+            std::istringstream input(texts);
+            sheet->LoadTexts(input);
+        }), "1000000 cells");
+    }
+}
+
+// Startup of the chained 10000x100 sheet of LoadTexts() with its values:
+// LoadTexts() and Recalculate() against LoadSnapshot() of the values saved
+void Snapshot() {
+    std::string texts;
+    for (int row = 0; row < 10000; ++row) {
+        texts += std::to_string(row);
+        for (int col = 1; col < 100; ++col)
+            texts += "\t=" + CellName(row, col - 1) + "+1";
+        texts += '\n';
+    }
+
+    std::optional<Sheet> sheet;
+    Report("snapshot/load-texts", Measure([&sheet] {
+        sheet.emplace();
+    }, [&sheet, &texts] {
+        std::istringstream input(texts);
+        sheet->LoadTexts(input);
+        sheet->Recalculate();
+    }), std::to_string(texts.size() >> 10) + " KiB of texts");
+
+    std::ostringstream output;
+    Report("snapshot/save", Measure([&output] {
+        output.str({});
+    }, [&sheet, &output] {
+        sheet->SaveSnapshot(output);
+    }));
+
+    const std::string data = output.str();
+    Report("snapshot/load", Measure([&sheet] {
+        sheet.emplace();
+    }, [&sheet, &data] {
+        sheet->LoadSnapshot(data);
+    }), std::to_string(data.size() >> 10) + " KiB of snapshot");
+}
+
+// ParseFormula() of 1000000 short formulas such as A1+B2 or (A1+B2)/3,
+// and the ANTLR reference parser on the same formulas
+void ParseFormulas() {
+    std::vector<std::string> formulas;
+    for (int i = 0; i < 1000000; ++i) {
+        const std::string lhs = CellName(i % 10000, i % 100);
+        const std::string rhs = CellName(i % 9000, i % 50 + 1);
+        switch (i % 4) {
+        case 0:
+            formulas.push_back(lhs + "+" + rhs);
+            break;
+        case 1:
+            formulas.push_back(lhs + "*2-" + rhs);
+            break;
+        case 2:
+            formulas.push_back(
+                "(" + lhs + "+" + rhs + ")/" + std::to_string(i % 7 + 1)
+            );
+            break;
+        default:
+            formulas.push_back("-" + lhs + "*(" + rhs + "-1.5)");
+        }
+    }
+
+    Report("parse-formulas/hand-written", Measure([] {}, [&formulas] {
+        for (const std::string& formula : formulas)
+            ParseFormula(formula);
+    }), "1000000 formulas");
+    Report("parse-formulas/antlr", Measure([] {}, [&formulas] {
+        for (const std::string& formula : formulas) {
+            std::istringstream input(formula);
+            ParseFormulaAST(input);
+        }
+    }), "1000000 formulas");
+}
+
+// SetCell() of one formula filled over 10000x100 cells, =<left>*2+1 in each,
+// and the heap the sheet takes per formula
+void FillFormulas() {
+    const int rows = 10000;
+    const int cols = 100;
+    std::optional<Sheet> sheet;
+    size_t sheet_heap = 0u;
+    const double ms = Measure([&sheet] {
+        sheet.emplace();
+    }, [&sheet, &sheet_heap] {
+        const size_t heap = GetHeapBytes();
+        for (int row = 0; row < rows; ++row)
+            for (int col = 1; col <= cols; ++col)
+                sheet->SetCell({row, col},
+                               "=" + CellName(row, col - 1) + "*2+1");
+        sheet_heap = GetHeapBytes() - heap;
+    });
+    Report("fill-formulas", ms, std::to_string(rows*cols) + " formulas, "
+           + std::to_string(sheet_heap / (rows*cols)) + " bytes per formula");
+}
+
+// 10000 overlapping ranged dependents =SUM(An:An+999) of column A: setting
+// them and editing every hundredth value of column A after Recalculate()
+void RangeEdits() {
+    const int formulas = 10000;
+    const int width = 1000;
+    std::optional<Sheet> sheet;
+    const double set_ms = Measure([&sheet] {
+        sheet.emplace();
+        for (int row = 0; row < formulas + width; ++row)
+            sheet->SetCell({row, 0}, std::to_string(row));
+    }, [&sheet] {
+        for (int row = 0; row < formulas; ++row)
+            sheet->SetCell({row, 1}, "=SUM(" + CellName(row, 0) + ":"
+                                     + CellName(row + width - 1, 0) + ")");
+    });
+    Report("range-edits/set", set_ms, std::to_string(formulas) + " ranges");
+
+    int edit = 0;
+    const double edit_ms = Measure([&sheet] {
+        sheet->Recalculate();
+    }, [&sheet, &edit] {
+        ++edit;
+        for (int row = 0; row < formulas + width; row += 100)
+            sheet->SetCell({row, 0}, std::to_string(row + edit));
+    });
+    Report("range-edits/edit", edit_ms,
+           std::to_string((formulas + width) / 100) + " edits");
+}
+
+// SetCell() of 10000x100 cells, values and formulas =<left>+1 in turn, into
+// an empty sheet and then over the same cells again, with the allocations
+// and the heap taken per cell
+void AllocateCells() {
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 10000; ++row)
+        for (int col = 0; col < 100; ++col) {
+            std::string text = col % 2 == 0
+                ? std::to_string(row + col)
+                : "=" + CellName(row, col - 1) + "+1";
+            cells.emplace_back(Position{row, col}, std::move(text));
+        }
+
+    std::optional<Sheet> sheet;
+    size_t cells_allocations = 0u;
+    long long cells_heap = 0;
+    const auto& set_cells = [&sheet, &cells, &cells_allocations, &cells_heap] {
+        const size_t count = GetAllocationsCount();
+        const size_t heap = GetHeapBytes();
+        for (const auto& [pos, text] : cells)
+            sheet->SetCell(pos, text);
+        cells_allocations = GetAllocationsCount() - count;
+        cells_heap = static_cast<long long>(GetHeapBytes())
+                     - static_cast<long long>(heap);
+    };
+    const auto& note = [&cells, &cells_allocations, &cells_heap] {
+        std::ostringstream output;
+        output << cells.size() << " cells, " << std::fixed
+               << std::setprecision(2)
+               << double(cells_allocations) / cells.size()
+               << " allocations and "
+               << cells_heap / static_cast<long long>(cells.size())
+               << " bytes per cell";
+        return output.str();
+    };
+
+    const double set_ms = Measure([&sheet] {
+        sheet.emplace();
+    }, set_cells);
+    Report("allocate-cells/set", set_ms, note());
+    const double reset_ms = Measure([] {}, set_cells);
+    std::string reset_note = note();
+    if (const size_t rss = GetPeakRssMiB())
+        reset_note += ", peak RSS " + std::to_string(rss) + " MiB";
+    Report("allocate-cells/reset", reset_ms, reset_note);
+}
+
+// SetCell() of a value with 1000000 formulas =A1+n over it and of the head of
+// a 100000-cell chain: on a recalculated sheet and again on a dirty one
+void Invalidate() {
+    std::string fan_out;
+    for (int row = 0; row < 10000; ++row) {
+        fan_out += row == 0 ? "1" : "";
+        for (int col = 1; col <= 100; ++col)
+            fan_out += "\t=A1+" + std::to_string(col);
+        fan_out += '\n';
+    }
+
+    // Column by column from A1 to the value in J10000
+    std::string chain;
+    for (int row = 0; row < 10000; ++row) {
+        for (int col = 0; col < 10; ++col) {
+            if (col > 0)
+                chain += '\t';
+            if (row + 1 < 10000)
+                chain += "=" + CellName(row + 1, col) + "+1";
+            else if (col + 1 < 10)
+                chain += "=" + CellName(0, col + 1) + "+1";
+            else
+                chain += "1";
+        }
+        chain += '\n';
+    }
+
+    for (const auto& [name, texts, edited] : {
+            std::tuple{"invalidate/fan-out/", &fan_out, "A1"_pos},
+            std::tuple{"invalidate/chain/", &chain, "J10000"_pos}}) {
+        Sheet sheet;
+        std::istringstream input(*texts);
+        sheet.LoadTexts(input);
+
+        int edit = 0;
+        const auto& set_edited = [&sheet, &edit, edited = edited] {
+            sheet.ResetCacheStatistics();
+            sheet.SetCell(edited, std::to_string(++edit));
+        };
+        const double clean_ms = Measure([&sheet] {
+            sheet.Recalculate();
+        }, set_edited);
+        Report(name + std::string("clean"), clean_ms,
+               std::to_string(sheet.GetCacheStatistics().invalidations)
+               + " invalidated");
+
+        const double dirty_ms = Measure([] {}, set_edited);
+        Report(name + std::string("dirty"), dirty_ms,
+               std::to_string(sheet.GetCacheStatistics().invalidations)
+               + " invalidated");
+    }
+}
+
+// Dependency graph of 10000x100 formulas =An+Am over the values of column
+// A: its lists in bytes per edge once the cells are loaded and after every
+// tenth formula is edited, when the edited lists sit in the patch buffers
+void GraphMemory() {
+    const int rows = 10000;
+    const int cols = 100;
+    const auto& formula = [](int row, int col, int edit) {
+        return "=" + CellName(row, 0) + "+"
+               + CellName((row + col + edit) % rows, 0);
+    };
+
+    std::string texts;
+    for (int row = 0; row < rows; ++row) {
+        texts += std::to_string(row);
+        for (int col = 1; col <= cols; ++col)
+            texts += '\t' + formula(row, col, 0);
+        texts += '\n';
+    }
+
+    std::optional<Sheet> sheet;
+    const auto& note = [&sheet] {
+        std::ostringstream output;
+        output << sheet->GetDependencyEdgesCount() << " edges, " << std::fixed
+               << std::setprecision(1)
+               << double(sheet->GetDependencyGraphBytes())
+                  / sheet->GetDependencyEdgesCount()
+               << " bytes per edge";
+        return output.str();
+    };
+
+    const double load_ms = Measure([&sheet] {
+        sheet.emplace();
+    }, [&sheet, &texts] {
+        std::istringstream input(texts);
+        sheet->LoadTexts(input);
+    });
+    Report("graph-memory/load", load_ms, note());
+
+    int edit = 0;
+    const double edit_ms = Measure([] {}, [&sheet, &formula, &edit] {
+        ++edit;
+        for (int row = 0; row < rows; ++row)
+            for (int col = row % 10 + 1; col <= cols; col += 10)
+                sheet->SetCell({row, col}, formula(row, col, edit));
+    });
+    Report("graph-memory/edit", edit_ms, note());
+}
+
+// Row inserted at the top of 10000 rows of a value and 10 formulas
+// =An*2+<left>, then deleted, each time after Recalculate()
+void ShiftRows() {
+    const int rows = 10000;
+    const int cols = 10;
+    std::string texts;
+    for (int row = 0; row < rows; ++row) {
+        texts += std::to_string(row);
+        for (int col = 1; col <= cols; ++col)
+            texts += "\t=" + CellName(row, 0) + "*2+" + CellName(row, col - 1);
+        texts += '\n';
+    }
+
+    Sheet sheet;
+    std::istringstream input(texts);
+    sheet.LoadTexts(input);
+
+    const auto& recalculate = [&sheet] {
+        sheet.Recalculate();
+        sheet.ResetCacheStatistics();
+    };
+    const auto& note = [&sheet] {
+        sheet.Recalculate();
+        return std::to_string(sheet.GetCacheStatistics().invalidations)
+               + " invalidated, "
+               + std::to_string(sheet.GetCacheStatistics().misses)
+               + " evaluated";
+    };
+
+    const double insert_ms = Measure(recalculate, [&sheet] {
+        sheet.InsertRows(0);
+    });
+    Report("shift-rows/insert", insert_ms, note());
+
+    const double delete_ms = Measure(recalculate, [&sheet] {
+        sheet.DeleteRows(0);
+    });
+    Report("shift-rows/delete", delete_ms, note());
+}
+
+const std::pair<std::string_view, void (*)()> SCENARIOS[] = {
+    {"recalculate-wide", RecalculateWide},
+    {"cycle-check-chain", CycleCheckChain},
+    {"error-cells", ErrorCells},
+    {"storage", Storage},
+    {"print", Print},
+    {"load-texts", LoadTexts},
+    {"snapshot", Snapshot},
+    {"parse-formulas", ParseFormulas},
+    {"fill-formulas", FillFormulas},
+    {"range-edits", RangeEdits},
+    {"allocate-cells", AllocateCells},
+    {"invalidate", Invalidate},
+    {"graph-memory", GraphMemory},
+    {"shift-rows", ShiftRows},
+};
+
+// Runs the scenarios with the names given, all of them if there are none
+int Run(const std::vector<std::string_view>& names) {
+    for (const std::string_view name : names)
+        if (std::none_of(std::begin(SCENARIOS), std::end(SCENARIOS),
+                         [name](const auto& s) { return s.first == name; })) {
+            std::cerr << "unknown benchmark " << name << std::endl;
+            return 1;
+        }
+
+    for (const auto& [name, scenario] : SCENARIOS)
+        if (names.empty() ||
+            std::find(names.begin(), names.end(), name) != names.end())
+            scenario();
+    return 0;
+}
+}  // namespace bench
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--bench")
+        return bench::Run({argv + 2, argv + argc});
+
     TestRunner tr;
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
@@ -171,6 +2230,40 @@ int main() {
     RUN_TEST(tr, TestThrowDiv0);
     RUN_TEST(tr, TestThrowValueError);
     RUN_TEST(tr, TestCircularDependencyException);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestFormulaCacheInvalidation);
+    RUN_TEST(tr, TestRecalculateDeepChain);
+    RUN_TEST(tr, TestParallelRecalculate);
+    RUN_TEST(tr, TestCircularDependencyDeepChain);
+    RUN_TEST(tr, TestFormulaProgram);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestTextNumbers);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestPrintNumbers);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestLoadTextsErrors);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSetCellsRollback);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSnapshotFile);
+    RUN_TEST(tr, TestSnapshotErrors);
+    RUN_TEST(tr, TestFormulaParsers);
+    RUN_TEST(tr, TestFormulaSharing);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestOverlappingRanges);
+    RUN_TEST(tr, TestColumnValues);
+    RUN_TEST(tr, TestCellReuse);
+    RUN_TEST(tr, TestCellContent);
+    RUN_TEST(tr, TestInvalidationCount);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestGetValues);
+    RUN_TEST(tr, TestInsertDeleteRows);
+    RUN_TEST(tr, TestInsertDeleteCols);
+    RUN_TEST(tr, TestShiftedCaches);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestWorkbookInsertDelete);
 
     return 0;
 }
\ No newline at end of file
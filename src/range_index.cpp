@@ -0,0 +1,114 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+
+void RangeIndex::Insert(Range range, Cell* cell) {
+    uint32_t node;
+    if (!released_nodes_.empty()) {
+        node = released_nodes_.back();
+        released_nodes_.pop_back();
+    } else {
+        node = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    nodes_[node] = {
+        range, cell, static_cast<uint32_t>(random_()), range.last.row
+    };
+
+    uint32_t less, rest;
+    Split(root_, range, cell, less, rest);
+    root_ = Merge(Merge(less, node), rest);
+}
+
+void RangeIndex::Erase(Range range, Cell* cell) {
+    root_ = Erase(root_, range, cell);
+}
+
+void RangeIndex::Clear() {
+    nodes_.clear();
+    released_nodes_.clear();
+    root_ = NIL;
+}
+
+bool RangeIndex::IsLess(const Node& node, Range range, const Cell* cell) {
+    const auto& key = [](Range key_range, const Cell* key_cell) {
+        return std::make_tuple(
+            key_range.first.row, key_range.first.col,
+            key_range.last.row, key_range.last.col,
+            reinterpret_cast<uintptr_t>(key_cell)
+        );
+    };
+
+    return key(node.range, node.cell) < key(range, cell);
+}
+
+void RangeIndex::Update(uint32_t node) {
+    Node& updated_node = nodes_[node];
+    updated_node.max_last_row = updated_node.range.last.row;
+    if (updated_node.left != NIL)
+        updated_node.max_last_row = std::max(
+            updated_node.max_last_row, nodes_[updated_node.left].max_last_row
+        );
+    if (updated_node.right != NIL)
+        updated_node.max_last_row = std::max(
+            updated_node.max_last_row, nodes_[updated_node.right].max_last_row
+        );
+}
+
+void RangeIndex::Split(uint32_t tree,
+                       Range range,
+                       const Cell* cell,
+                       uint32_t& less,
+                       uint32_t& rest) {
+    if (tree == NIL) {
+        less = rest = NIL;
+        return;
+    }
+
+    if (IsLess(nodes_[tree], range, cell)) {
+        Split(nodes_[tree].right, range, cell, nodes_[tree].right, rest);
+        less = tree;
+    } else {
+        Split(nodes_[tree].left, range, cell, less, nodes_[tree].left);
+        rest = tree;
+    }
+    Update(tree);
+}
+
+uint32_t RangeIndex::Merge(uint32_t less, uint32_t rest) {
+    if (less == NIL)
+        return rest;
+    if (rest == NIL)
+        return less;
+
+    // Node of the higher priority is the root of the merged tree
+    if (nodes_[less].priority > nodes_[rest].priority) {
+        nodes_[less].right = Merge(nodes_[less].right, rest);
+        Update(less);
+        return less;
+    }
+
+    nodes_[rest].left = Merge(less, nodes_[rest].left);
+    Update(rest);
+    return rest;
+}
+
+uint32_t RangeIndex::Erase(uint32_t tree, Range range, const Cell* cell) {
+    if (tree == NIL)
+        return NIL;
+
+    Node& node = nodes_[tree];
+    if (node.range == range && node.cell == cell) {
+        released_nodes_.push_back(tree);
+        return Merge(node.left, node.right);
+    }
+
+    if (IsLess(node, range, cell))
+        nodes_[tree].right = Erase(node.right, range, cell);
+    else
+        nodes_[tree].left = Erase(node.left, range, cell);
+    Update(tree);
+    return tree;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+class Cell;
+
+// Cells referring to the ranges of a sheet. Range is a single edge of the
+// dependency graph, so a changed cell finds the formulas depending on it
+// here instead of the cells of the range keeping their dependents.
+//
+// Ranges are kept in an interval tree over the rows: a treap ordered by the
+// first row of the ranges, each node knows the last row of its subtree. The
+// ranges containing a position are found in O(log(n) + k) for k ranges
+// crossing its row, the columns are checked for those only.
+class RangeIndex {
+public:
+    void Insert(Range range, Cell* cell);
+
+    // Erases the entry of the cell referring to the range
+    void Erase(Range range, Cell* cell);
+
+    inline bool IsEmpty() const {
+        return root_ == NIL;
+    }
+
+    void Clear();
+
+    // Calls fn(cell) for each cell referring to a range containing pos
+    template <typename Fn>
+    inline void ForEachDependent(Position pos, Fn fn) const {
+        ForEachDependent(root_, pos, fn);
+    }
+
+    // Calls fn(cell) for each cell referring to a range intersecting range
+    template <typename Fn>
+    inline void ForEachIntersecting(Range range, Fn fn) const {
+        ForEachIntersecting(root_, range, fn);
+    }
+
+private:
+    static const uint32_t NIL = UINT32_MAX;
+
+    struct Node {
+        Range range;
+        Cell* cell;
+        uint32_t priority;
+
+        // Largest last row of the ranges in the subtree
+        int max_last_row;
+        uint32_t left = NIL;
+        uint32_t right = NIL;
+    };
+
+    // Nodes are linked by indices, released ones are reused by Insert()
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> released_nodes_;
+    uint32_t root_ = NIL;
+    std::minstd_rand random_;
+
+    // Total order of the entries: by the range corners, then by the cell
+    static bool IsLess(const Node& node, Range range, const Cell* cell);
+
+    void Update(uint32_t node);
+
+    // Splits the tree into the entries less than (range, cell) and the rest
+    void Split(uint32_t tree,
+               Range range,
+               const Cell* cell,
+               uint32_t& less,
+               uint32_t& rest);
+
+    uint32_t Merge(uint32_t less, uint32_t rest);
+
+    uint32_t Erase(uint32_t tree, Range range, const Cell* cell);
+
+    template <typename Fn>
+    void ForEachDependent(uint32_t tree, Position pos, Fn& fn) const;
+
+    template <typename Fn>
+    void ForEachIntersecting(uint32_t tree, Range range, Fn& fn) const;
+};
+
+template <typename Fn>
+void RangeIndex::ForEachDependent(uint32_t tree, Position pos, Fn& fn) const {
+    // Left subtrees are walked recursively and right ones in the loop, all
+    // the ranges of the skipped subtrees end above pos or start below it
+    while (tree != NIL && nodes_[tree].max_last_row >= pos.row) {
+        const Node& node = nodes_[tree];
+        ForEachDependent(node.left, pos, fn);
+        if (node.range.first.row > pos.row)
+            return;
+
+        if (node.range.Contains(pos))
+            fn(node.cell);
+        tree = node.right;
+    }
+}
+
+template <typename Fn>
+void RangeIndex::ForEachIntersecting(uint32_t tree, Range range, Fn& fn) const {
+    // Same walk as ForEachDependent() for the rows of the range
+    while (tree != NIL && nodes_[tree].max_last_row >= range.first.row) {
+        const Node& node = nodes_[tree];
+        ForEachIntersecting(node.left, range, fn);
+        if (node.range.first.row > range.last.row)
+            return;
+
+        if (
+            node.range.last.row >= range.first.row
+            && node.range.first.col <= range.last.col
+            && node.range.last.col >= range.first.col
+        )
+            fn(node.cell);
+        tree = node.right;
+    }
+}
@@ -1,42 +1,636 @@
 #include "sheet.h"
 
+#include <charconv>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+
 void Sheet::SetCell(Position pos, std::string text) {
     ThrowInvalidPosition(pos);
 
-    Increase(pos);
+    Cell& cell = InsertCell(pos);
+    const bool was_empty = IsCellEmpty(&cell);
+    const std::vector<Position> referenced_cells = cell.GetReferencedCells();
+    try {
+        cell.Set(std::move(text));
+    } catch (...) {
+        EraseUnusedCell(pos);
+        throw;
+    }
+
+    // Empty cells created for the replaced references may be unused now
+    for (const Position& referenced_pos : referenced_cells)
+        EraseUnusedCell(referenced_pos);
+
+    if (was_empty && !cell.IsEmpty())
+        IncreasePrintableSize(pos);
+    else if (!was_empty && cell.IsEmpty())
+        DecreasePrintableSize(pos);
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells)
+        ThrowInvalidPosition(pos);
+
+    CellsEdit edit = BeginEdit(std::move(cells));
+    try {
+        Cell::Update(edit.cells, std::move(edit.texts), workers_count_);
+    } catch (...) {
+        AbortEdit(edit);
+        throw;
+    }
+    CommitEdit(edit);
+}
+
+Sheet::CellsEdit Sheet::BeginEdit(
+    std::vector<std::pair<Position, std::string>> cells
+) {
+    // Later texts of the same position replace the earlier ones
+    CellsEdit edit;
+    std::unordered_set<const Cell*> updated_cells_set;
+    for (auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        Cell& cell = InsertCell(it->first);
+        if (updated_cells_set.insert(&cell).second) {
+            edit.positions.push_back(it->first);
+            edit.cells.push_back(&cell);
+            edit.texts.push_back(std::move(it->second));
+        }
+    }
 
-    std::unique_ptr<Cell>& cell = rows_[pos.row][pos.col];
-    if (!cell)
-        cell = std::make_unique<Cell>(*this);
-    cell->Set(text);
+    for (const Cell* cell : edit.cells) {
+        edit.were_empty.push_back(cell->IsEmpty());
+        for (const Position& referenced_pos : cell->GetReferencedCells())
+            edit.referenced_cells.push_back(referenced_pos);
+    }
+
+    return edit;
+}
+
+void Sheet::CommitEdit(const CellsEdit& edit) {
+    for (const Position& referenced_pos : edit.referenced_cells)
+        EraseUnusedCell(referenced_pos);
+
+    for (size_t i = 0; i < edit.cells.size(); ++i) {
+        if (edit.were_empty[i] && !edit.cells[i]->IsEmpty())
+            IncreasePrintableSize(edit.positions[i]);
+        else if (!edit.were_empty[i] && edit.cells[i]->IsEmpty())
+            DecreasePrintableSize(edit.positions[i]);
+    }
+}
+
+void Sheet::AbortEdit(const CellsEdit& edit) {
+    for (const Position& pos : edit.positions)
+        EraseUnusedCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     ThrowInvalidPosition(pos);
-    if (IsExist(pos) && rows_[pos.row][pos.col]) {
-        Row& row = rows_[pos.row];
-        row[pos.col]->Clear();
-        if (row.size() == static_cast<size_t>(pos.col + 1))
-            Shrink();
+    if (cells_.Find(pos)) {
+        SetCell(pos, {});
+        EraseUnusedCell(pos);
+    }
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ThrowInvalidPosition({before, 0});
+    ThrowInvalidCount(count);
+    ShiftCells(true, before, std::min(count, Position::MAX_ROWS - before));
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ThrowInvalidPosition({0, before});
+    ThrowInvalidCount(count);
+    ShiftCells(false, before, std::min(count, Position::MAX_COLS - before));
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ThrowInvalidPosition({first, 0});
+    ThrowInvalidCount(count);
+    ShiftCells(true, first, -std::min(count, Position::MAX_ROWS - first));
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ThrowInvalidPosition({0, first});
+    ThrowInvalidCount(count);
+    ShiftCells(false, first, -std::min(count, Position::MAX_COLS - first));
+}
+
+namespace {
+// Insertion of count rows or columns before first, or deletion of -count of
+// them starting at first, on the sheet named sheet_name in its workbook
+class IndexShift {
+public:
+    IndexShift(bool is_rows, int first, int count, std::string_view sheet_name)
+        : is_rows_(is_rows)
+        , first_(first)
+        , count_(count)
+        , size_(is_rows ? Position::MAX_ROWS : Position::MAX_COLS)
+        , sheet_name_(sheet_name) {
+    }
+
+    // Returns Position::NONE for a deleted cell, throws TableTooBigException
+    // if the cell is shifted out of the table
+    Position operator()(Position pos) const {
+        int& index = is_rows_ ? pos.row : pos.col;
+        if (index < first_)
+            return pos;
+        if (count_ < 0 && index < first_ - count_)
+            return Position::NONE;
+
+        index += count_;
+        if (index >= size_)
+            throw TableTooBigException("cell is out of the table");
+        return pos;
+    }
+
+    // Returns nullopt for a deleted range. Partly deleted ranges shrink and
+    // the ranges crossing the inserted ones grow, up to the end of the table.
+    std::optional<Range> operator()(Range range) const {
+        int& first = is_rows_ ? range.first.row : range.first.col;
+        int& last = is_rows_ ? range.last.row : range.last.col;
+        if (count_ >= 0) {
+            first += first >= first_ ? count_ : 0;
+            last += last >= first_ ? count_ : 0;
+            if (first >= size_)
+                throw TableTooBigException("range is out of the table");
+            last = std::min(last, size_ - 1);
+            return range;
+        }
+
+        // Deleted corners move to the nearest kept rows or columns inside
+        first = first < first_ ? first : std::max(first + count_, first_);
+        last = last < first_ ? last : std::max(last + count_, first_ - 1);
+        if (first > last)
+            return std::nullopt;
+        return range;
+    }
+
+    // Text of the cell with the formula references to the shifted sheet
+    // shifted, the deleted ones are replaced with #REF!. References without
+    // a sheet name are shifted only in the cells of the shifted sheet.
+    std::string ShiftText(std::string text, bool is_shifted_sheet) const {
+        if (text.size() <= 1u || text[0] != FORMULA_SIGN)
+            return text;
+
+        const std::string_view deleted
+            = FormulaError(FormulaError::Category::Ref).ToString();
+        std::string shifted_text(1, FORMULA_SIGN);
+        shifted_text.reserve(text.size() + 8u);
+        TokenizeFormula(
+            std::string_view(text).substr(1),
+            [&](std::string_view token, std::optional<Range> range) {
+                const size_t prefix_size = token.find('!') + 1u;
+                const std::string_view prefix = token.substr(0, prefix_size);
+                if (
+                    !range
+                    || (prefix.empty()
+                        ? !is_shifted_sheet
+                        : prefix.substr(0, prefix.size() - 1u) != sheet_name_)
+                ) {
+                    shifted_text.append(token);
+                } else if (token.find(':') == std::string_view::npos) {
+                    const Position pos = (*this)(range->first);
+                    if (pos.IsValid())
+                        shifted_text.append(prefix) += pos.ToString();
+                    else
+                        shifted_text.append(deleted);
+                } else if (const auto shifted_range = (*this)(*range)) {
+                    shifted_text.append(prefix) += shifted_range->ToString();
+                } else {
+                    shifted_text.append(deleted);
+                }
+            }
+        );
+
+        return shifted_text;
+    }
+
+private:
+    bool is_rows_;
+    int first_;
+    int count_;
+    int size_;
+    std::string_view sheet_name_;
+};
+}  // namespace
+
+void Sheet::ShiftCells(bool is_rows, int first, int count) {
+    if (count == 0)
+        return;
+
+    const IndexShift shift(is_rows, first, count, context_.name);
+    const Position offset = is_rows ? Position{count, 0} : Position{0, count};
+    const Range shifted_area = {
+        is_rows ? Position{first, 0} : Position{0, first},
+        {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}
+    };
+    const auto& move = [&offset](Position pos) {
+        return Position{pos.row + offset.row, pos.col + offset.col};
+    };
+    const auto& is_moved = [is_rows, first, count](Position pos) {
+        return (is_rows ? pos.row : pos.col) >= first + std::max(-count, 0);
+    };
+
+    // Formula of a moved cell keeps its shape if all its references move
+    // with it. Referenced positions are shifted here to throw
+    // TableTooBigException before anything is changed.
+    const auto& moves_with_references = [&](const Cell& cell) {
+        for (const Position& pos : cell.GetReferencedCells())
+            if (!is_moved(pos) || !(shift(pos) == move(pos)))
+                return false;
+        for (const auto& [context, range] : cell.GetReferencedRanges()) {
+            if (context != &context_ || !is_moved(range.first))
+                return false;
+
+            const Range moved_range = {move(range.first), move(range.last)};
+            if (!(shift(range) == moved_range))
+                return false;
+        }
+        return true;
+    };
+
+    // Cells of the area are moved by the storage with their ids. Only the
+    // formulas whose references cross the first shifted row or column, or
+    // refer to the deleted cells, are set again with shifted texts. These
+    // are found through the dependents of the area cells and through the
+    // ranges crossing it, on all the sheets of the workbook.
+    std::vector<std::pair<Position, std::string>> deleted_cells;
+    std::vector<std::pair<Position, std::string>> shifted_cells;
+    std::unordered_set<const Cell*> shifted_formulas;
+    std::unordered_set<const Cell*> referring_cells;
+    cells_.ForEachInRange(shifted_area, [&](const Cell& cell) {
+        context_.dependents.ForEach(cell.GetId(), [&](CellId dependent_id) {
+            referring_cells.insert(cells_.Get(dependent_id));
+        });
+
+        const Position pos = cell.GetPosition();
+        const Position shifted_pos = shift(pos);
+        if (!shifted_pos.IsValid()) {
+            deleted_cells.emplace_back(pos, std::string());
+        } else if (!moves_with_references(cell)) {
+            shifted_formulas.insert(&cell);
+            shifted_cells.emplace_back(
+                shifted_pos,
+                shift.ShiftText(cell.GetText(), true)
+            );
+        }
+    });
+    context_.ranges.ForEachIntersecting(
+        shifted_area,
+        [&referring_cells](const Cell* cell) {
+            referring_cells.insert(cell);
+        }
+    );
+
+    // Cells of a workbook are created by its sheets only
+    std::unordered_map<
+        Sheet*,
+        std::vector<std::pair<Position, std::string>>
+    > other_sheets_cells;
+    for (const Cell* cell : referring_cells) {
+        const Position pos = cell->GetPosition();
+        Sheet& sheet = static_cast<Sheet&>(cell->GetSheet());
+        if (&sheet == this && shifted_area.Contains(pos))
+            continue;
+
+        std::string text = cell->GetText();
+        std::string shifted_text = shift.ShiftText(text, &sheet == this);
+        if (shifted_text == text)
+            continue;
+        if (&sheet == this)
+            shifted_cells.emplace_back(pos, std::move(shifted_text));
+        else
+            other_sheets_cells[&sheet].emplace_back(
+                pos,
+                std::move(shifted_text)
+            );
+    }
+
+    // Deleted cells are cleared in place, the formulas referring to them are
+    // set again below. Their ids are kept until then.
+    if (!deleted_cells.empty())
+        SetCells(std::move(deleted_cells));
+
+    std::vector<Cell*> moved_cells;
+    cells_.ForEachInRange(shifted_area, [&](const Cell& cell) {
+        if (is_moved(cell.GetPosition())) {
+            moved_cells.push_back(const_cast<Cell*>(&cell));
+            context_.values.Set(cell.GetPosition(), ValueStore::Tag::Empty);
+        }
+    });
+    const std::vector<Cell*> removed_cells
+        = cells_.Shift(is_rows, first, count);
+    ShiftPrintableSize(is_rows, first, count);
+
+    for (Cell* cell : moved_cells)
+        if (shifted_formulas.count(cell) == 0u && !cell->Move(offset))
+            shifted_cells.emplace_back(
+                cell->GetPosition(),
+                shift.ShiftText(cell->GetText(), true)
+            );
+
+    // Texts of all the sheets are one edit, so that a failure leaves every
+    // sheet with the texts it had after the move
+    std::vector<std::pair<Sheet*, CellsEdit>> edits;
+    edits.emplace_back(this, BeginEdit(std::move(shifted_cells)));
+    for (auto& [sheet, sheet_cells] : other_sheets_cells)
+        edits.emplace_back(sheet, sheet->BeginEdit(std::move(sheet_cells)));
+
+    std::vector<Cell*> updated_cells;
+    std::vector<std::string> texts;
+    for (auto& [sheet, edit] : edits) {
+        updated_cells.insert(
+            updated_cells.end(), edit.cells.begin(), edit.cells.end()
+        );
+        texts.insert(
+            texts.end(),
+            std::make_move_iterator(edit.texts.begin()),
+            std::make_move_iterator(edit.texts.end())
+        );
+    }
+
+    try {
+        Cell::Update(updated_cells, std::move(texts), workers_count_);
+    } catch (...) {
+        for (const auto& [sheet, edit] : edits)
+            sheet->AbortEdit(edit);
+        throw;
+    }
+
+    for (const auto& [sheet, edit] : edits)
+        sheet->CommitEdit(edit);
+    for (Cell* cell : removed_cells)
+        cells_.Release(*cell);
+}
+
+void Sheet::LoadTexts(std::istream& input) {
+    const std::string content(std::istreambuf_iterator<char>(input), {});
+
+    Reset();
+
+    std::vector<Position> positions;
+    std::vector<std::string> texts;
+    Position pos;
+    for (size_t begin = 0; begin < content.size();) {
+        const size_t end = std::min(
+            content.find_first_of("\t\n", begin), content.size()
+        );
+        if (end > begin) {
+            if (!pos.IsValid()) {
+                Reset();
+                ThrowInvalidPosition(pos);
+            }
+            positions.push_back(pos);
+            texts.emplace_back(content, begin, end - begin);
+        }
+
+        if (end < content.size() && content[end] == '\n')
+            pos = {pos.row + 1, 0};
+        else
+            ++pos.col;
+        begin = end + 1;
+    }
+
+    std::vector<Cell*> cells;
+    cells.reserve(positions.size());
+    for (const Position& cell_pos : positions)
+        cells.push_back(&InsertCell(cell_pos));
+
+    try {
+        Cell::Load(cells, std::move(texts), workers_count_);
+    } catch (...) {
+        Reset();
+        throw;
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i)
+        if (!cells[i]->IsEmpty())
+            IncreasePrintableSize(positions[i]);
+}
+
+namespace {
+// "SSNP" in the little endian byte order
+const uint32_t SNAPSHOT_MAGIC = 0x504e5353u;
+const uint32_t SNAPSHOT_VERSION = 3u;
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+    Recalculate();
+
+    std::vector<Position> positions;
+    std::vector<const Cell*> cells;
+    cells_.ForEach([&positions, &cells](Position pos, const Cell& cell) {
+        if (!cell.IsEmpty()) {
+            positions.push_back(pos);
+            cells.push_back(&cell);
+        }
+    });
+
+    // Empty cells are not written, they are created again by the formulas
+    // referring to them
+    SnapshotWriter writer(output);
+    writer.Write(SNAPSHOT_MAGIC);
+    writer.Write(SNAPSHOT_VERSION);
+    writer.Write(static_cast<uint64_t>(positions.size()));
+    for (const Position& pos : positions)
+        writer.Write(pos);
+    for (const Cell* cell : cells)
+        cell->Save(writer);
+}
+
+void Sheet::LoadSnapshot(std::string_view data) {
+    Reset();
+
+    std::vector<Position> positions;
+    std::vector<Cell*> cells;
+    try {
+        SnapshotReader reader(data);
+        if (
+            reader.Read<uint32_t>() != SNAPSHOT_MAGIC
+            || reader.Read<uint32_t>() != SNAPSHOT_VERSION
+        )
+            throw SnapshotException("unsupported snapshot format");
+
+        const uint64_t cells_count = reader.Read<uint64_t>();
+        for (uint64_t i = 0; i < cells_count; ++i) {
+            const Position pos = reader.Read<Position>();
+            if (!pos.IsValid() || cells_.Find(pos))
+                throw SnapshotException("invalid cell position");
+
+            positions.push_back(pos);
+            cells.push_back(&InsertCell(pos));
+        }
+
+        Cell::Restore(cells, reader);
+        if (!reader.IsEnd())
+            throw SnapshotException("unexpected data after snapshot");
+    } catch (...) {
+        Reset();
+        throw;
     }
+
+    for (size_t i = 0; i < cells.size(); ++i)
+        if (!cells[i]->IsEmpty())
+            IncreasePrintableSize(positions[i]);
+}
+
+void Sheet::LoadSnapshotFile(const std::string& path) {
+    const MappedFile file(path);
+    LoadSnapshot(file.GetData());
 }
 
-void Sheet::Increase(Position pos) {
-    rows_.resize(std::max(rows_.size(), static_cast<size_t>(pos.row + 1)));
+void Sheet::Recalculate() const {
+    std::vector<const Cell*> dirty_cells;
+    cells_.ForEach([&dirty_cells](Position, const Cell& cell) {
+        if (!cell.IsCached())
+            dirty_cells.push_back(&cell);
+    });
+
+    Cell::Recalculate(dirty_cells, workers_count_);
+}
+
+std::vector<CellInterface::Value> Sheet::GetValues(Range range) const {
+    ThrowInvalidPosition(range.first);
+    ThrowInvalidPosition(range.last);
+    if (!range.IsValid())
+        throw InvalidPositionException("-> " + range.ToString());
+
+    std::vector<const Cell*> dirty_cells;
+    cells_.ForEachInRange(range, [&dirty_cells](const Cell& cell) {
+        if (!cell.IsCached())
+            dirty_cells.push_back(&cell);
+    });
+    Cell::Recalculate(dirty_cells, workers_count_);
 
-    Row& row = rows_.at(pos.row);
-    row.resize(std::max(row.size(), static_cast<size_t>(pos.col + 1)));
+    const size_t cols = range.last.col - range.first.col + 1;
+    std::vector<CellInterface::Value> values(
+        (range.last.row - range.first.row + 1)*cols
+    );
+    cells_.ForEachInRange(range, [&range, &values, cols](const Cell& cell) {
+        const Position pos = cell.GetPosition();
+        values[(pos.row - range.first.row)*cols + pos.col - range.first.col]
+            = cell.GetValue();
+    });
 
-    columns_count_ = std::max(row.size(), columns_count_);
+    return values;
 }
 
-void Sheet::Shrink() {
-    columns_count_ = {};
-    for (Row& row : rows_) {
-        DropTail(row, IsCellEmpty);
-        columns_count_ = std::max(row.size(), columns_count_);
+void Sheet::Reset() {
+    if (context_.workbook) {
+        // Formulas of the other sheets stay in the range index, the ones of
+        // this sheet leave the indexes of all the sheets
+        std::vector<Position> positions;
+        cells_.ForEach([&positions](Position pos, const Cell&) {
+            positions.push_back(pos);
+        });
+        for (const Position& pos : positions)
+            cells_.Find(pos)->UnlinkRanges();
+
+        context_.ranges.ForEachIntersecting(
+            {{0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}},
+            [](Cell* cell) {
+                cell->Invalidate();
+            }
+        );
+    } else {
+        context_.ranges.Clear();
     }
-    DropTail(rows_, [](const auto& row) { return row.empty(); });
+
+    cells_ = {};
+    context_.values.Clear();
+    context_.precedents.Clear();
+    context_.dependents.Clear();
+    printable_size_ = {};
+    row_cells_count_.clear();
+    col_cells_count_.clear();
+}
+
+void Sheet::IncreasePrintableSize(Position pos) {
+    row_cells_count_.resize(
+        std::max(row_cells_count_.size(), static_cast<size_t>(pos.row + 1))
+    );
+    col_cells_count_.resize(
+        std::max(col_cells_count_.size(), static_cast<size_t>(pos.col + 1))
+    );
+    ++row_cells_count_[pos.row];
+    ++col_cells_count_[pos.col];
+
+    printable_size_ = {
+        std::max(printable_size_.rows, pos.row + 1),
+        std::max(printable_size_.cols, pos.col + 1)
+    };
+}
+
+void Sheet::ShiftPrintableSize(bool is_rows, int first, int count) {
+    std::vector<int>& cells_count = is_rows
+                                    ? row_cells_count_
+                                    : col_cells_count_;
+    if (static_cast<size_t>(first) < cells_count.size()) {
+        const auto begin = cells_count.begin() + first;
+        if (count > 0)
+            cells_count.insert(begin, count, 0);
+        else
+            cells_count.erase(
+                begin,
+                begin + std::min<size_t>(-count, cells_count.end() - begin)
+            );
+    }
+
+    // Border moves to the last row/column with not empty cells
+    while (!cells_count.empty() && cells_count.back() == 0)
+        cells_count.pop_back();
+    (is_rows ? printable_size_.rows : printable_size_.cols)
+        = static_cast<int>(cells_count.size());
+}
+
+void Sheet::DecreasePrintableSize(Position pos) {
+    --row_cells_count_[pos.row];
+    --col_cells_count_[pos.col];
+
+    // Border moves back to the last row/column with not empty cells
+    while (
+        printable_size_.rows > 0
+        && row_cells_count_[printable_size_.rows - 1] == 0
+    )
+        --printable_size_.rows;
+    while (
+        printable_size_.cols > 0
+        && col_cells_count_[printable_size_.cols - 1] == 0
+    )
+        --printable_size_.cols;
+}
+
+Sheet::OutputBuffer::OutputBuffer(std::ostream& output)
+    : output_(output)
+    , is_default_format_(
+        output.precision() == 6
+        && (output.flags() & ~(std::ios_base::dec | std::ios_base::skipws))
+            == std::ios_base::fmtflags{}
+    ) {
+    buffer_.reserve(CAPACITY + CAPACITY/2);
+}
+
+void Sheet::OutputBuffer::operator()(double value) {
+    if (!is_default_format_) {
+        Flush();
+        output_ << value;
+        return;
+    }
+
+    // Default stream format is the same as printf("%g")
+    char number[32];
+    const auto result = std::to_chars(
+        std::begin(number), std::end(number),
+        value,
+        std::chars_format::general, 6
+    );
+    buffer_.append(number, result.ptr);
+    FlushIfFull();
+}
+
+void Sheet::OutputBuffer::Flush() {
+    output_.write(buffer_.data(), buffer_.size());
+    buffer_.clear();
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
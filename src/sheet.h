@@ -2,32 +2,58 @@
 
 #include "cell.h"
 #include "common.h"
+#include "storage.h"
 
 #include <algorithm>
 #include <iostream>
 #include <functional>
 
-class Sheet : public SheetInterface {
-    using Row = std::vector<std::unique_ptr<Cell>>;
+class Workbook;
 
-    class CellValuePrinter {
+class Sheet : public SheetInterface {
+    // Collects printed cells in a large buffer written to the stream at once.
+    // Numbers are formatted with std::to_chars while the stream keeps the
+    // default format, the output is the same as of operator<<.
+    class OutputBuffer {
     public:
-        CellValuePrinter(std::ostream& output) : out_(output) {}
+        explicit OutputBuffer(std::ostream& output);
+
+        inline ~OutputBuffer() {
+            Flush();
+        }
 
-        inline void operator()(const std::string& value) {
-            out_ << value;
+        inline void operator()(char c) {
+            buffer_.push_back(c);
         }
 
-        inline void operator()(double value) {
-            out_ << value;
+        inline void operator()(std::string_view value) {
+            buffer_.append(value);
+            FlushIfFull();
         }
 
+        void operator()(double value);
+
         inline void operator()(FormulaError value) {
-            out_ << value.ToString();
+            (*this)(value.ToString());
+        }
+
+        inline std::string& GetBuffer() {
+            return buffer_;
         }
 
+        inline void FlushIfFull() {
+            if (buffer_.size() >= CAPACITY)
+                Flush();
+        }
+
+        void Flush();
+
     private:
-        std::ostream& out_;
+        static const size_t CAPACITY = 1u << 16;
+
+        std::ostream& output_;
+        std::string buffer_;
+        bool is_default_format_;
     };
 
 public:
@@ -35,44 +61,126 @@ public:
 
     void SetCell(Position pos, std::string text) override;
 
+    void SetCells(std::vector<std::pair<Position, std::string>> cells) override;
+
     inline const CellInterface* GetCell(Position pos) const override {
         return const_cast<Sheet&>(*this).GetCell(pos);
     }
 
     inline CellInterface* GetCell(Position pos) override {
         ThrowInvalidPosition(pos);
-        return IsExist(pos) ? rows_[pos.row][pos.col].get() : nullptr;
+        return cells_.Find(pos);
     }
 
     void ClearCell(Position pos) override;
 
+    void InsertRows(int before, int count = 1) override;
+
+    void InsertCols(int before, int count = 1) override;
+
+    void DeleteRows(int first, int count = 1) override;
+
+    void DeleteCols(int first, int count = 1) override;
+
     inline Size GetPrintableSize() const override {
-        return {
-            static_cast<int>(rows_.size()),
-            static_cast<int>(columns_count_)
-        };
+        return printable_size_;
     }
 
     inline void PrintValues(std::ostream& output) const override {
-        PrintCells(output, [&output](const std::unique_ptr<Cell>& cell) {
-            if (cell)
-                std::visit(CellValuePrinter(output), cell->GetValue());
+        PrintCells(output, [](OutputBuffer& buffer, const Cell& cell) {
+            std::visit(buffer, cell.GetValueView());
         });
     }
 
     inline void PrintTexts(std::ostream& output) const override {
-        PrintCells(output, [&output](const std::unique_ptr<Cell>& cell) {
-            if (cell)
-                output << cell->GetText();
+        PrintCells(output, [](OutputBuffer& buffer, const Cell& cell) {
+            cell.AppendText(buffer.GetBuffer());
+            buffer.FlushIfFull();
         });
     }
 
+    // Replaces the sheet content with the tab separated texts in the
+    // PrintTexts() format. Formulas are parsed in parallel and linked at once.
+    // Leaves the sheet empty if the texts are invalid or form a cycle.
+    void LoadTexts(std::istream& input);
+
+    // Writes the binary snapshot of the sheet: texts, compiled formulas and
+    // their values. Dirty cells are evaluated before writing.
+    void SaveSnapshot(std::ostream& output) const;
+
+    // Replaces the sheet content with the snapshot written by SaveSnapshot(),
+    // formulas are restored without parsing. Leaves the sheet empty and
+    // throws SnapshotException if the snapshot is invalid.
+    void LoadSnapshot(std::string_view data);
+
+    // Loads the snapshot file mapped into memory
+    void LoadSnapshotFile(const std::string& path);
+
+    // Evaluates all the dirty formula cells in dependency order
+    void Recalculate() const;
+
+    // Returns values of the range cells row by row, missing cells are empty.
+    // Only the dirty cells of the range are evaluated with the cells they
+    // refer to, the rest of the sheet stays dirty until it is read.
+    std::vector<CellInterface::Value> GetValues(Range range) const;
+
+    // Number of threads used by Recalculate(), 1 means serial evaluation
+    inline void SetWorkersCount(size_t workers_count) {
+        workers_count_ = std::max(workers_count, size_t{1});
+    }
+
+    inline size_t GetWorkersCount() const {
+        return workers_count_;
+    }
+
+    inline const Cell::CacheStatistics& GetCacheStatistics() const {
+        return context_.cache_statistics;
+    }
+
+    // Number of distinct relative formulas shared by the cells
+    inline size_t GetFormulaShapesCount() const {
+        return context_.formulas.GetShapesCount();
+    }
+
+    // Edges of the dependency graph between the cells, ranges are indexed
+    // apart from it
+    inline size_t GetDependencyEdgesCount() const {
+        return context_.dependents.GetIdsCount();
+    }
+
+    // Bytes reserved by the lists of the dependency graph in both directions
+    inline size_t GetDependencyGraphBytes() const {
+        return context_.precedents.GetCapacityBytes()
+               + context_.dependents.GetCapacityBytes();
+    }
+
+    inline void ResetCacheStatistics() {
+        context_.cache_statistics.hits = 0;
+        context_.cache_statistics.misses = 0;
+        context_.cache_statistics.invalidations = 0;
+    }
+
 private:
-    std::vector<Row> rows_; // store cells by rows up to last not empty one
-    size_t columns_count_ = {};
+    friend class Workbook;
 
-    inline static bool IsCellEmpty(const std::unique_ptr<Cell>& cell) {
-        return !(cell && !cell->GetText().empty());
+    // Context is declared first, so that it outlives the cells referring
+    // to it
+    Cell::Context context_ = {*this, cells_};
+    CellStorage cells_;
+
+    // Printable area is kept up to date with not empty cells count for each
+    // row and column, so that clearing a cell does not rescan the sheet
+    Size printable_size_;
+    std::vector<int> row_cells_count_;
+    std::vector<int> col_cells_count_;
+    size_t workers_count_ = 1u;
+
+    inline static bool IsCellEmpty(const Cell* cell) {
+        return !cell || cell->IsEmpty();
+    }
+
+    inline static bool IsCellUnused(const Cell* cell) {
+        return IsCellEmpty(cell) && !(cell && cell->IsReferenced());
     }
 
     inline void ThrowInvalidPosition(const Position pos) const {
@@ -84,52 +192,78 @@ private:
             );
     }
 
-    inline bool IsExist(const Position pos) const {
-        return static_cast<size_t>(pos.row) < rows_.size()
-            && static_cast<size_t>(pos.col) < rows_[pos.row].size();
+    inline void ThrowInvalidCount(int count) const {
+        if (count < 0)
+            throw InvalidPositionException(
+                "-> count " + std::to_string(count)
+            );
+    }
+
+    inline Cell& InsertCell(Position pos) {
+        return cells_.Insert(pos, context_);
+    }
+
+    // Releases cells which are neither printed nor referenced by formulas
+    inline void EraseUnusedCell(Position pos) {
+        if (Cell* cell = cells_.Find(pos); cell && IsCellUnused(cell))
+            cells_.Erase(pos);
     }
 
-    // Корректирует размер таблицы, если позиция выходит за её размеры
-    // и при необходимости увеличивает длину строки pos.row
-    void Increase(Position pos);
+    // Cells of a SetCells() edit with their state before it
+    struct CellsEdit {
+        std::vector<Position> positions;
+        std::vector<Cell*> cells;
+        std::vector<std::string> texts;
+        std::vector<bool> were_empty;
+        std::vector<Position> referenced_cells;
+    };
+
+    // Inserts the missing cells of the edit, later texts of a position
+    // replace the earlier ones
+    CellsEdit BeginEdit(std::vector<std::pair<Position, std::string>> cells);
+
+    // Releases the cells left unused and updates the printable area after
+    // the texts of the edit are set
+    void CommitEdit(const CellsEdit& edit);
+
+    // Releases the cells inserted for the edit which failed
+    void AbortEdit(const CellsEdit& edit);
 
-    void Shrink();
+    void IncreasePrintableSize(Position pos);
 
-    template<typename T, typename Fn>
-    void DropTail(std::vector<T>& v, Fn is_empty);
+    // Removes all the cells keeping the settings and the statistics. Formulas
+    // of the other sheets of the workbook referring to the cells are kept and
+    // their caches are dropped.
+    void Reset();
+
+    void DecreasePrintableSize(Position pos);
+
+    // Inserts count rows or columns before first if count is positive and
+    // deletes -count of them starting at first otherwise. Cells at and after
+    // first are moved with their ids, content and caches. Only the formulas
+    // whose references cross first or refer to the deleted cells are set
+    // again, on all the sheets of the workbook as one edit. Throws
+    // TableTooBigException before any change.
+    void ShiftCells(bool is_rows, int first, int count);
+
+    // Shifts the not empty cells counts of the rows or the columns of a
+    // ShiftCells() call and updates the printable area
+    void ShiftPrintableSize(bool is_rows, int first, int count);
 
     template<typename Predicate>
     void PrintCells(std::ostream& output, Predicate print_cell) const;
 };
 
-template<typename T, typename Predicate>
-void Sheet::DropTail(std::vector<T>& v, Predicate predicate) {
-    v.resize(std::distance(
-        std::find_if_not(v.rbegin(), v.rend(), predicate),
-        v.rend()
-    ));
-}
-
 template <typename Predicate>
 void Sheet::PrintCells(std::ostream& output, Predicate print_cell) const {
-    for (const Row& row : rows_) {
-        // Print row (rows stored to the last not empty cell) 
-        if (!row.empty()) {
-            print_cell(row.front());
-            std::for_each(
-                std::next(row.begin()),
-                row.end(),
-                [&](const std::unique_ptr<Cell>& cell) {
-                    output << '\t';
-                    print_cell(cell);
-                }
-            );
+    OutputBuffer buffer(output);
+    for (int i = 0; i < printable_size_.rows; ++i) {
+        for (int j = 0; j < printable_size_.cols; ++j) {
+            if (j > 0)
+                buffer('\t');
+            if (const Cell* cell = cells_.Find({i, j}))
+                print_cell(buffer, *cell);
         }
-
-        // Simulate dropped tail with tabs 
-        for (size_t j = row.size(); j < columns_count_; ++j)
-            output << '\t';
-
-        output << '\n';
+        buffer('\n');
     }
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Uninitialized memory for a single object of type T
+template <typename T>
+struct alignas(T) ObjectStorage {
+    unsigned char bytes[sizeof(T)];
+};
+
+// Sequence of objects constructed in place in slabs of SLAB_SIZE objects.
+// Unlike std::deque the slabs are sized for the objects, so that a few
+// allocations serve many of them, and the objects never move.
+template <typename T, size_t SLAB_SIZE>
+class SlabVector {
+public:
+    SlabVector() = default;
+    SlabVector(const SlabVector&) = delete;
+    SlabVector& operator=(const SlabVector&) = delete;
+
+    SlabVector(SlabVector&& other) noexcept
+        : slabs_(std::move(other.slabs_))
+        , size_(std::exchange(other.size_, 0u)) {
+    }
+
+    SlabVector& operator=(SlabVector&& other) noexcept {
+        if (this != &other) {
+            Destroy();
+            slabs_ = std::move(other.slabs_);
+            size_ = std::exchange(other.size_, 0u);
+        }
+        return *this;
+    }
+
+    ~SlabVector() {
+        Destroy();
+    }
+
+    template <typename... Args>
+    T& EmplaceBack(Args&&... args) {
+        if (size_ == slabs_.size()*SLAB_SIZE)
+            slabs_.emplace_back(new ObjectStorage<T>[SLAB_SIZE]);
+
+        T* object = new (&slabs_.back()[size_ % SLAB_SIZE]) T(
+            std::forward<Args>(args)...
+        );
+        ++size_;
+        return *object;
+    }
+
+    inline T& operator[](size_t index) {
+        assert(index < size_);
+        return *std::launder(reinterpret_cast<T*>(
+            &slabs_[index/SLAB_SIZE][index % SLAB_SIZE]
+        ));
+    }
+
+    inline const T& operator[](size_t index) const {
+        return const_cast<SlabVector&>(*this)[index];
+    }
+
+    inline size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    std::vector<std::unique_ptr<ObjectStorage<T>[]>> slabs_;
+    size_t size_ = 0u;
+
+    void Destroy() {
+        for (size_t i = 0; i < size_; ++i)
+            (*this)[i].~T();
+        slabs_.clear();
+        size_ = 0u;
+    }
+};
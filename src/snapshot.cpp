@@ -0,0 +1,86 @@
+#include "snapshot.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path) {
+    file_ = CreateFileA(
+        path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+    );
+    if (file_ == INVALID_HANDLE_VALUE) {
+        file_ = nullptr;
+        throw SnapshotException("cannot open " + path);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size)) {
+        CloseHandle(file_);
+        throw SnapshotException("cannot read " + path);
+    }
+
+    // Empty files cannot be mapped and are left with no data
+    size_ = static_cast<size_t>(size.QuadPart);
+    if (size_ == 0u)
+        return;
+
+    mapping_ = CreateFileMappingA(
+        file_, nullptr, PAGE_READONLY, 0, 0, nullptr
+    );
+    data_ = mapping_
+            ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)
+            : nullptr;
+    if (!data_) {
+        if (mapping_)
+            CloseHandle(mapping_);
+        CloseHandle(file_);
+        throw SnapshotException("cannot map " + path);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (data_)
+        UnmapViewOfFile(data_);
+    if (mapping_)
+        CloseHandle(mapping_);
+    if (file_)
+        CloseHandle(file_);
+}
+#else
+MappedFile::MappedFile(const std::string& path) {
+    const int file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        throw SnapshotException("cannot open " + path);
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0) {
+        close(file);
+        throw SnapshotException("cannot read " + path);
+    }
+
+    // Empty files cannot be mapped and are left with no data
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if (size_ > 0u) {
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data_ == MAP_FAILED)
+            data_ = nullptr;
+    }
+
+    // Mapping stays valid after the file is closed
+    close(file);
+    if (size_ > 0u && !data_)
+        throw SnapshotException("cannot map " + path);
+}
+
+MappedFile::~MappedFile() {
+    if (data_)
+        munmap(data_, size_);
+}
+#endif
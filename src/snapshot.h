@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Thrown when a snapshot cannot be read or was written by another version
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Writes trivially copyable values to the binary snapshot as they are in
+// memory, so a snapshot is read back by the same build on the same platform
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(std::ostream& output) : output_(output) {}
+
+    template <typename T>
+    inline void Write(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        output_.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    inline void WriteString(std::string_view value) {
+        Write(static_cast<uint32_t>(value.size()));
+        output_.write(value.data(), value.size());
+    }
+
+private:
+    std::ostream& output_;
+};
+
+// Reads the values written by SnapshotWriter from a memory buffer, usually
+// a mapped file. Throws SnapshotException on reading past the end.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data) : data_(data) {}
+
+    template <typename T>
+    inline T Read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    // Returned view refers to the read buffer
+    inline std::string_view ReadString() {
+        const size_t size = Read<uint32_t>();
+        return {Take(size), size};
+    }
+
+    inline bool IsEnd() const {
+        return data_.empty();
+    }
+
+private:
+    std::string_view data_;
+
+    inline const char* Take(size_t size) {
+        if (data_.size() < size)
+            throw SnapshotException("unexpected end of snapshot");
+
+        const char* begin = data_.data();
+        data_.remove_prefix(size);
+        return begin;
+    }
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    inline std::string_view GetData() const {
+        return {static_cast<const char*>(data_), size_};
+    }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0u;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
@@ -0,0 +1,112 @@
+#include "storage.h"
+
+#include <algorithm>
+#include <cassert>
+
+Cell& CellStorage::Insert(Position pos, Cell::Context& context) {
+    CellId& slot = InsertSlot(pos);
+    if (slot)
+        return *Get(slot - 1u);
+
+    // Released cells are empty and not referenced, so they are reused at
+    // the new position as is
+    CellId id;
+    if (!released_ids_.empty()) {
+        id = released_ids_.back();
+        released_ids_.pop_back();
+        cells_[id].SetPosition(pos);
+    } else {
+        id = static_cast<CellId>(cells_.GetSize());
+        cells_.EmplaceBack(context, pos, id);
+    }
+    slot = id + 1u;
+
+    ++cells_count_;
+    return cells_[id];
+}
+
+void CellStorage::Erase(Position pos) {
+    Block* block = const_cast<Block*>(FindBlock(pos));
+    if (!block)
+        return;
+
+    CellId& slot = block->slots[GetSlotIndex(pos)];
+    if (!slot)
+        return;
+
+    released_ids_.push_back(slot - 1u);
+    slot = 0u;
+    --cells_count_;
+
+    if (--block->cells_count == 0)
+        block_rows_[pos.row/BLOCK_SIZE][pos.col/BLOCK_SIZE].reset();
+}
+
+std::vector<Cell*> CellStorage::Shift(bool is_rows, int first, int count) {
+    const Range area = {
+        is_rows ? Position{first, 0} : Position{0, first},
+        {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}
+    };
+    std::vector<Cell*> moved_cells;
+    ForEachInRange(area, [&moved_cells](const Cell& cell) {
+        moved_cells.push_back(const_cast<Cell*>(&cell));
+    });
+
+    // All the ids are taken out before any is put back, so that the moved
+    // cells never meet each other. Blocks left empty are released at the end.
+    for (const Cell* cell : moved_cells) {
+        const Position pos = cell->GetPosition();
+        Block& block = *block_rows_[pos.row/BLOCK_SIZE][pos.col/BLOCK_SIZE];
+        block.slots[GetSlotIndex(pos)] = 0u;
+        --block.cells_count;
+    }
+
+    std::vector<Cell*> removed_cells;
+    for (Cell* cell : moved_cells) {
+        Position pos = cell->GetPosition();
+        int& index = is_rows ? pos.row : pos.col;
+        if (count < 0 && index < first - count) {
+            removed_cells.push_back(cell);
+            --cells_count_;
+            continue;
+        }
+
+        index += count;
+        assert(pos.IsValid());
+        cell->SetPosition(pos);
+        InsertSlot(pos) = cell->GetId() + 1u;
+    }
+
+    for (size_t i = area.first.row/BLOCK_SIZE; i < block_rows_.size(); ++i)
+        for (
+            size_t j = area.first.col/BLOCK_SIZE;
+            j < block_rows_[i].size();
+            ++j
+        )
+            if (block_rows_[i][j] && block_rows_[i][j]->cells_count == 0)
+                block_rows_[i][j].reset();
+
+    return removed_cells;
+}
+
+void CellStorage::Release(Cell& cell) {
+    released_ids_.push_back(cell.GetId());
+}
+
+CellId& CellStorage::InsertSlot(Position pos) {
+    const size_t block_row = pos.row/BLOCK_SIZE;
+    const size_t block_col = pos.col/BLOCK_SIZE;
+    block_rows_.resize(std::max(block_rows_.size(), block_row + 1));
+
+    BlockRow& row = block_rows_[block_row];
+    row.resize(std::max(row.size(), block_col + 1));
+
+    std::unique_ptr<Block>& block = row[block_col];
+    if (!block)
+        block = std::make_unique<Block>();
+
+    CellId& slot = block->slots[GetSlotIndex(pos)];
+    if (!slot)
+        ++block->cells_count;
+    return slot;
+}
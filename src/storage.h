@@ -0,0 +1,157 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "slab_vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Sparse storage of the sheet cells. Positions are mapped to the cell ids
+// in 64x64 blocks found through a two-level table (rows of blocks), so
+// memory grows with the populated blocks only. Cells are kept in slabs by
+// their dense ids and never move once created. Rows and columns are
+// shifted by moving the ids between the blocks, the cells keep their ids
+// and content. Released cells are reused with their ids by the next
+// insertions.
+class CellStorage {
+    static const int BLOCK_SIZE = 64;
+    static const int BLOCK_AREA = BLOCK_SIZE*BLOCK_SIZE;
+
+    struct Block {
+        // Cell id + 1 for each position of the block, 0 if there is none
+        std::array<CellId, BLOCK_AREA> slots = {};
+        int cells_count = 0;
+    };
+
+    using BlockRow = std::vector<std::unique_ptr<Block>>;
+
+public:
+    inline Cell* Find(Position pos) const {
+        const Block* block = FindBlock(pos);
+        if (!block)
+            return nullptr;
+
+        const CellId slot = block->slots[GetSlotIndex(pos)];
+        return slot ? Get(slot - 1u) : nullptr;
+    }
+
+    inline Cell* Get(CellId id) const {
+        return const_cast<Cell*>(&cells_[id]);
+    }
+
+    // Returns the cell at pos, creating an empty one if there is none
+    Cell& Insert(Position pos, Cell::Context& context);
+
+    // Releases the cell at pos, the cell must be empty and not referenced
+    void Erase(Position pos);
+
+    // Moves the cells at and after the first row (column) by count rows
+    // (columns), no cell may leave the table. For a negative count the cells
+    // of the -count rows (columns) starting at first are taken out of the
+    // table and returned, they keep their ids until released.
+    std::vector<Cell*> Shift(bool is_rows, int first, int count);
+
+    // Releases the cell taken out of the table by Shift(), the cell must be
+    // empty and not referenced
+    void Release(Cell& cell);
+
+    inline size_t GetCellsCount() const {
+        return cells_count_;
+    }
+
+    template <typename Fn>
+    void ForEach(Fn fn) const;
+
+    template <typename Fn>
+    void ForEachInRange(Range range, Fn fn) const;
+
+private:
+    std::vector<BlockRow> block_rows_;
+    size_t cells_count_ = 0u;
+
+    // Cells by their ids, the released ones are empty
+    SlabVector<Cell, 64> cells_;
+    std::vector<CellId> released_ids_;
+
+    inline static int GetSlotIndex(Position pos) {
+        return (pos.row % BLOCK_SIZE)*BLOCK_SIZE + pos.col % BLOCK_SIZE;
+    }
+
+    inline const Block* FindBlock(Position pos) const {
+        const size_t block_row = pos.row/BLOCK_SIZE;
+        const size_t block_col = pos.col/BLOCK_SIZE;
+        return block_row < block_rows_.size()
+               && block_col < block_rows_[block_row].size()
+               ? block_rows_[block_row][block_col].get()
+               : nullptr;
+    }
+
+    // Returns the slot of the position, creating its block if there is none
+    CellId& InsertSlot(Position pos);
+};
+
+// Calls fn(position, cell) for all the stored cells
+template <typename Fn>
+void CellStorage::ForEach(Fn fn) const {
+    for (size_t i = 0; i < block_rows_.size(); ++i)
+        for (size_t j = 0; j < block_rows_[i].size(); ++j) {
+            const Block* block = block_rows_[i][j].get();
+            if (!block)
+                continue;
+
+            for (int slot_index = 0; slot_index < BLOCK_AREA; ++slot_index)
+                if (const CellId slot = block->slots[slot_index])
+                    fn(
+                        Position{
+                            static_cast<int>(i)*BLOCK_SIZE
+                                + slot_index/BLOCK_SIZE,
+                            static_cast<int>(j)*BLOCK_SIZE
+                                + slot_index%BLOCK_SIZE
+                        },
+                        cells_[slot - 1u]
+                    );
+        }
+}
+
+// Calls fn(cell) for the stored cells of the range, only the populated
+// blocks intersecting the range are visited
+template <typename Fn>
+void CellStorage::ForEachInRange(Range range, Fn fn) const {
+    const size_t last_block_row = std::min(
+        static_cast<size_t>(range.last.row/BLOCK_SIZE) + 1u,
+        block_rows_.size()
+    );
+    for (size_t i = range.first.row/BLOCK_SIZE; i < last_block_row; ++i) {
+        const BlockRow& block_row = block_rows_[i];
+        const size_t last_block_col = std::min(
+            static_cast<size_t>(range.last.col/BLOCK_SIZE) + 1u,
+            block_row.size()
+        );
+        for (size_t j = range.first.col/BLOCK_SIZE; j < last_block_col; ++j) {
+            const Block* block = block_row[j].get();
+            if (!block)
+                continue;
+
+            const int row_offset = static_cast<int>(i)*BLOCK_SIZE;
+            const int col_offset = static_cast<int>(j)*BLOCK_SIZE;
+            const int first_row = std::max(range.first.row - row_offset, 0);
+            const int last_row = std::min(
+                range.last.row - row_offset, BLOCK_SIZE - 1
+            );
+            const int first_col = std::max(range.first.col - col_offset, 0);
+            const int last_col = std::min(
+                range.last.col - col_offset, BLOCK_SIZE - 1
+            );
+            for (int row = first_row; row <= last_row; ++row)
+                for (int col = first_col; col <= last_col; ++col) {
+                    const CellId slot = block->slots[row*BLOCK_SIZE + col];
+                    if (slot)
+                        fn(cells_[slot - 1u]);
+                }
+        }
+    }
+}
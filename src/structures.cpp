@@ -66,4 +66,27 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     else
         return {convert_row(row_name), convert_column(column_name)};
+}
+
+std::string Range::ToString() const {
+    if (!IsValid())
+        return {};
+
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromString(std::string_view str) {
+    const size_t colon = str.find(':');
+    if (colon == std::string_view::npos)
+        return {Position::NONE, Position::NONE};
+
+    const Position first = Position::FromString(str.substr(0, colon));
+    const Position last = Position::FromString(str.substr(colon + 1));
+    if (!first.IsValid() || !last.IsValid())
+        return {Position::NONE, Position::NONE};
+
+    return {
+        {std::min(first.row, last.row), std::min(first.col, last.col)},
+        {std::max(first.row, last.row), std::max(first.col, last.col)}
+    };
 }
\ No newline at end of file
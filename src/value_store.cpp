@@ -0,0 +1,21 @@
+#include "value_store.h"
+
+void ValueStore::Set(Position pos, Tag tag, double number) {
+    const size_t block_index = pos.row/BLOCK_ROWS;
+    if (!FindBlock(pos.col, static_cast<int>(block_index))) {
+        // Missing blocks are empty already
+        if (tag == Tag::Empty)
+            return;
+
+        columns_.resize(
+            std::max(columns_.size(), static_cast<size_t>(pos.col) + 1u)
+        );
+        Column& column = columns_[pos.col];
+        column.resize(std::max(column.size(), block_index + 1u));
+        column[block_index] = std::make_unique<Block>();
+    }
+
+    Block& block = *columns_[pos.col][block_index];
+    block.tags[pos.row % BLOCK_ROWS] = tag;
+    block.numbers[pos.row % BLOCK_ROWS] = number;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Values of the sheet cells as read by formulas, kept in columns apart from
+// the cells. Each column is split into blocks of dense numbers with a tag
+// per row, so that the range scans read contiguous memory instead of going
+// through the cells. Positions of the missing blocks are empty.
+//
+// Setting a position set before does not allocate, so the cells evaluated
+// in parallel store their values concurrently.
+class ValueStore {
+public:
+    enum class Tag : uint8_t {
+        // Missing or empty cell, zero for the cell references
+        Empty,
+        Number,
+        // Not numeric text, skipped by the ranges
+        Text,
+        // Formula to be evaluated
+        Dirty,
+        // Formula error, its category is kept instead of the number
+        Error,
+    };
+
+    struct Value {
+        Tag tag;
+        double number;
+    };
+
+    static constexpr int BLOCK_ROWS = 256;
+
+    void Set(Position pos, Tag tag, double number = .0);
+
+    inline Value Get(Position pos) const {
+        const Block* block = FindBlock(pos.col, pos.row/BLOCK_ROWS);
+        if (!block)
+            return {Tag::Empty, .0};
+
+        const int row = pos.row % BLOCK_ROWS;
+        return {block->tags[row], block->numbers[row]};
+    }
+
+    inline void Clear() {
+        columns_.clear();
+    }
+
+    // Calls fn(first_row, tags, numbers, count) for the stored parts of the
+    // column rows [first_row, last_row]
+    template <typename Fn>
+    void ForEachSegment(int col, int first_row, int last_row, Fn fn) const;
+
+private:
+    struct Block {
+        std::array<double, BLOCK_ROWS> numbers = {};
+        std::array<Tag, BLOCK_ROWS> tags = {};
+    };
+
+    using Column = std::vector<std::unique_ptr<Block>>;
+
+    std::vector<Column> columns_;
+
+    inline const Block* FindBlock(int col, int block_index) const {
+        return static_cast<size_t>(col) < columns_.size()
+               && static_cast<size_t>(block_index) < columns_[col].size()
+               ? columns_[col][block_index].get()
+               : nullptr;
+    }
+};
+
+template <typename Fn>
+void ValueStore::ForEachSegment(int col,
+                                int first_row,
+                                int last_row,
+                                Fn fn) const {
+    if (static_cast<size_t>(col) >= columns_.size())
+        return;
+
+    const Column& column = columns_[col];
+    const int last_block = std::min(
+        last_row/BLOCK_ROWS, static_cast<int>(column.size()) - 1
+    );
+    for (int i = first_row/BLOCK_ROWS; i <= last_block; ++i) {
+        const Block* block = column[i].get();
+        if (!block)
+            continue;
+
+        const int begin = std::max(first_row - i*BLOCK_ROWS, 0);
+        const int end = std::min(last_row - i*BLOCK_ROWS + 1, BLOCK_ROWS);
+        fn(
+            i*BLOCK_ROWS + begin,
+            block->tags.data() + begin,
+            block->numbers.data() + begin,
+            static_cast<size_t>(end - begin)
+        );
+    }
+}
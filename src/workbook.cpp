@@ -0,0 +1,53 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace {
+bool IsSheetName(std::string_view name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+
+    for (const char c : name)
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    return true;
+}
+}  // namespace
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsSheetName(name))
+        throw std::invalid_argument("invalid sheet name " + name);
+    if (sheets_by_name_.count(name) != 0u)
+        throw std::invalid_argument("sheet " + name + " already exists");
+
+    Sheet& sheet = *sheets_.emplace_back(std::make_unique<Sheet>());
+    sheet.context_.workbook = this;
+    sheet.context_.name = name;
+    sheet.SetWorkersCount(workers_count_);
+    sheets_by_name_.emplace(std::move(name), &sheet);
+    return sheet;
+}
+
+void Workbook::Recalculate() const {
+    std::vector<const Cell*> dirty_cells;
+    for (const auto& sheet : sheets_)
+        sheet->cells_.ForEach([&dirty_cells](Position, const Cell& cell) {
+            if (!cell.IsCached())
+                dirty_cells.push_back(&cell);
+        });
+
+    Cell::Recalculate(dirty_cells, workers_count_);
+}
+
+void Workbook::SetWorkersCount(size_t workers_count) {
+    workers_count_ = std::max(workers_count, size_t{1});
+    for (const auto& sheet : sheets_)
+        sheet->SetWorkersCount(workers_count_);
+}
+
+Cell::Context* Workbook::FindContext(std::string_view name) const {
+    const auto it = sheets_by_name_.find(name);
+    return it != sheets_by_name_.end() ? &it->second->context_ : nullptr;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Named sheets whose formulas refer to each other, e.g. =Sheet2!A1 or
+// =SUM(Data!A1:B10). Cells of all the sheets form one dependency graph: an
+// edit of a sheet drops the caches of the formulas on the other sheets
+// referring to it, cycles across the sheets are rejected and Recalculate()
+// evaluates the dirty cells of all the sheets in one dependency order.
+class Workbook {
+public:
+    Workbook() = default;
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Adds an empty sheet. Throws std::invalid_argument if the name is taken
+    // or does not match [A-Za-z_][A-Za-z0-9_]*.
+    Sheet& AddSheet(std::string name);
+
+    // Returns nullptr if there is no sheet with the name
+    inline Sheet* GetSheet(std::string_view name) {
+        const auto it = sheets_by_name_.find(name);
+        return it != sheets_by_name_.end() ? it->second : nullptr;
+    }
+
+    inline const Sheet* GetSheet(std::string_view name) const {
+        return const_cast<Workbook&>(*this).GetSheet(name);
+    }
+
+    inline size_t GetSheetsCount() const {
+        return sheets_.size();
+    }
+
+    // Evaluates all the dirty formula cells of all the sheets in dependency
+    // order
+    void Recalculate() const;
+
+    // Number of threads used by Recalculate() and by the sheets
+    void SetWorkersCount(size_t workers_count);
+
+    inline size_t GetWorkersCount() const {
+        return workers_count_;
+    }
+
+    // Context of the sheet read by the formulas referring to it by name,
+    // nullptr if there is no such sheet
+    Cell::Context* FindContext(std::string_view name) const;
+
+private:
+    // Sheets are kept in the order of addition and never move, so that the
+    // formulas keep pointers to their contexts
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::map<std::string, Sheet*, std::less<>> sheets_by_name_;
+    size_t workers_count_ = 1u;
+};